@@ -1,5 +1,48 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <system_error>
 #include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "include/parallel_accumulate.h"
+#include "include/thread_wrappers.h"
 
 void do_something(int &i); // takes an reference as parameter
 void do_something_in_current_thread();
@@ -47,6 +90,13 @@ struct func
             do_something(i); // oops() might finish but do_something still running and has
                              // access to destroyed var. This is Undefined Behaivor!
     }
+
+    // picked by joining_thread (see 2.3): stops within one iteration once asked to
+    void operator()(std::stop_token stop)
+    {
+        for (unsigned j = 0; j < 1000000 && !stop.stop_requested(); ++j)
+            do_something(i);
+    }
 };
 
 void oops()
@@ -108,28 +158,7 @@ void f()
 // Try-catch is verbose. It's not ideal
 // If thread must join before function ends, it also must be the same case in every possible senario
 
-// One way to achieve this to use RAII
-
-class thread_guard
-{
-    std::thread &t;
-
-public:
-    explicit thread_guard(std::thread &t_) : t(t_) {}
-
-    ~thread_guard()
-    {
-        if (t.joinable())
-        {
-            t.join();
-        }
-    }
-
-    thread_guard(thread_guard const &) = delete;            // copy constructor
-    thread_guard &operator=(thread_guard const &) = delete; // copy assignment
-    /* copy constructor and assignment is dangerous because it might outlive 
-        the scope of the thread it was joining.*/
-};
+// thread_guard, and the lifecycle metrics it reports to: include/thread_wrappers.h
 
 void f2()
 {
@@ -268,23 +297,7 @@ void g()
     f(std::move(t));
 }
 
-class scoped_thread
-{
-    std::thread t;
-
-public:
-    explicit scoped_thread(std::thread t_) : t(std::move(t_))
-    {
-        if (!t.joinable())
-            throw std::logic_error(“No thread”);
-    }
-    ~scoped_thread()
-    {
-        t.join();
-    }
-    scoped_thread(scoped_thread const &) = delete;
-    scoped_thread &operator=(scoped_thread const &) = delete;
-};
+// scoped_thread, with stop_source cancellation: include/thread_wrappers.h
 
 struct func;
 
@@ -295,84 +308,257 @@ void f()
     do_something_in_current_thread();
 }
 
-class joining_thread{
-    std::thread t;
-public:
-    joining_thread() noexcept = default;
-    template<typename Callable, typename ... Args>
-    explicit joining_thread(Callable&& func, Args&& ... args):
-        t(std::forward<Callable>(func), std::forward<Args>(args)...)
-    {}
+void f_cancellable()
+{
+    int some_local_state = 0;
+    std::stop_source stop;
+    scoped_thread t{std::thread(func(some_local_state), stop.get_token()), stop};
+    do_something_in_current_thread();
+} // asks func to stop, then joins
 
-    explicit joining_thread(std::thread t_) noexcept:
-        t(std::move(t_)) 
-    {}
+// joining_thread, thread_launch_options, native_thread and spin_latch: include/thread_wrappers.h
 
-    joining_thread(joining_thread&& other) noexcept:
-        t(std::move(other.t))
-    {}
+void do_work(uint8_t id);
 
-    joining_thread& operator=(joining_thread&& other) noexcept {
-        if(joinable())
-            join();
-        t = std::move(other.t);
-        return *this;
+void f() {
+    std::vector<std::thread> threads;
+    for (uint8_t i = 0; i < 20; ++i)
+    {
+        threads.emplace_back(do_work, i);
     }
+    for (auto &entry : threads)
+        entry.join();
+}
 
-    joining_thread& operator=(std::thread other) noexcept {
-        if(joinable())
-            join();
-        t = std::move(other);
-        return *this;
-    } 
 
-    ~joining_thread() noexcept {
-        if(joinable())
-            join();
-    }
+// shared_span and launch_owning: include/thread_wrappers.h
+
+void checksum_part(shared_span<char> part);
+
+void checksum_payload(std::vector<char> payload) // e.g. a multi-megabyte message
+{
+    shared_span<char> const shared = make_shared_span(std::move(payload));
+    std::size_t const half = shared.size() / 2;
+    joining_thread first = launch_owning(checksum_part, shared.subspan(0, half));
+    joining_thread second = launch_owning(checksum_part, shared.subspan(half));
+    // launch_owning(checksum_part, buffer) or (f, 3, buffer) from oops() wouldn't compile
+}
+
+/** Supervising background threads instead of detach()
+ * 
+ * oops() and edit_document (2.1.4) detach and forget: there's no bound on how many daemon
+ * threads pile up, and at exit they keep running while statics are destroyed under them.
+ * background_supervisor owns them instead:
+ * 
+ *  - at most max_threads threads; a launch reuses an idle one, starts a new one while under
+ *    the cap, and otherwise waits in a queue for the next free thread
+ *  - every task has a name and a start time; stragglers(threshold) lists the ones running
+ *    longer than threshold
+ *  - a callable taking a std::stop_token (first) gets one; drain() requests stop, drops
+ *    tasks that haven't started (their futures report broken_promise) and waits up to a
+ *    timeout for the running ones
+ *  - the destructor drains. Tasks still running after drain_timeout are reported; then
+ *    they're joined (on_drain_timeout::wait) or left behind (::abandon). Abandoned threads
+ *    keep the supervisor's own state alive, so they never touch freed supervisor memory,
+ *    but whatever their task references is the task's problem, exactly as with detach().
+*/
+
+struct background_task_info
+{
+    std::string name;
+    std::chrono::steady_clock::duration running_for;
+};
+
+class background_supervisor
+{
+public:
+    enum class on_drain_timeout { wait, abandon };
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct job
+    {
+        std::string name;
+        std::packaged_task<void(std::stop_token)> task;
+    };
+
+    struct worker_slot
+    {
+        std::string name;
+        clock::time_point started;
+        bool busy = false;
+    };
 
-    void swap(joining_thread &other) noexcept {
-        t.swap(other.t);
+    struct shared_state
+    {
+        std::mutex m;
+        std::condition_variable work_or_drain;
+        std::condition_variable task_done;
+        std::deque<job> queue;
+        std::deque<worker_slot> slots; // one per thread; deque: never moves them
+        std::vector<std::thread> threads;
+        std::size_t busy = 0;
+        bool accepting = true;
+        std::stop_source stop;
+    };
+
+    std::shared_ptr<shared_state> state;
+    std::size_t max_threads;
+    std::chrono::milliseconds drain_timeout;
+    on_drain_timeout policy;
+
+    static void worker(std::shared_ptr<shared_state> st, std::size_t index)
+    {
+        std::unique_lock<std::mutex> lk(st->m);
+        for (;;)
+        {
+            st->work_or_drain.wait(lk, [&st] { return !st->queue.empty() || !st->accepting; });
+            if (st->queue.empty())
+                return;
+            job next = std::move(st->queue.front());
+            st->queue.pop_front();
+
+            worker_slot &slot = st->slots[index];
+            slot.name = std::move(next.name);
+            slot.started = clock::now();
+            slot.busy = true;
+            ++st->busy;
+            lk.unlock();
+            next.task(st->stop.get_token()); // exceptions end up in the future
+            lk.lock();
+            slot.busy = false;
+            --st->busy;
+            st->task_done.notify_all();
+        }
     }
 
-    std::thread::id get_id() const noexcept {
-        return t.get_id();
+    static void report_stragglers(std::vector<background_task_info> const &stragglers)
+    {
+        for (auto const &entry : stragglers)
+            std::cerr << "background task '" << entry.name << "' still running after "
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(entry.running_for).count()
+                      << " ms\n";
     }
 
-    bool joinable() const noexcept {
-        return t.joinable();
+public:
+    explicit background_supervisor(std::size_t max_threads_ = 16,
+                                   std::chrono::milliseconds drain_timeout_ = std::chrono::seconds(5),
+                                   on_drain_timeout policy_ = on_drain_timeout::wait)
+        : state(std::make_shared<shared_state>()), max_threads(std::max<std::size_t>(max_threads_, 1)),
+          drain_timeout(drain_timeout_), policy(policy_)
+    {}
+
+    ~background_supervisor()
+    {
+        bool const drained = drain(drain_timeout);
+        if (!drained)
+            report_stragglers(stragglers(clock::duration::zero()));
+
+        std::vector<std::thread> threads;
+        {
+            std::lock_guard<std::mutex> lk(state->m);
+            threads.swap(state->threads);
+        }
+        for (auto &entry : threads)
+        {
+            if (drained || policy == on_drain_timeout::wait)
+                entry.join();
+            else
+                entry.detach();
+        }
     }
-   
-    void join() {
-        t.join();
+
+    background_supervisor(background_supervisor const &) = delete;
+    background_supervisor &operator=(background_supervisor const &) = delete;
+
+    template <typename Callable>
+    std::future<void> launch(std::string name, Callable &&func)
+    {
+        std::packaged_task<void(std::stop_token)> task(
+            [f = std::forward<Callable>(func)](std::stop_token stop) mutable {
+                if constexpr (std::is_invocable_v<std::decay_t<Callable> &, std::stop_token>)
+                    f(std::move(stop));
+                else
+                    f();
+            });
+        std::future<void> result = task.get_future();
+
+        std::lock_guard<std::mutex> lk(state->m);
+        if (!state->accepting)
+            throw std::logic_error("background_supervisor: launch after drain");
+        state->queue.push_back(job{std::move(name), std::move(task)});
+        std::size_t const idle = state->threads.size() - state->busy;
+        if (state->queue.size() > idle && state->threads.size() < max_threads)
+        {
+            state->slots.emplace_back();
+            state->threads.emplace_back(&background_supervisor::worker, state,
+                                        state->threads.size());
+        }
+        state->work_or_drain.notify_one();
+        return result;
     }
-    
-    void detach() {
-        t.detach();
+
+    // Stop accepting work and wait up to timeout; true if nothing is left running
+    template <typename Rep, typename Period>
+    bool drain(std::chrono::duration<Rep, Period> timeout)
+    {
+        std::unique_lock<std::mutex> lk(state->m);
+        state->accepting = false;
+        state->queue.clear();
+        state->stop.request_stop();
+        state->work_or_drain.notify_all();
+        return state->task_done.wait_for(lk, timeout, [this] { return state->busy == 0; });
     }
-    
-    std::thread &as_thread() noexcept {
-        return t;
+
+    std::vector<background_task_info> stragglers(clock::duration threshold) const
+    {
+        std::vector<background_task_info> result;
+        auto const now = clock::now();
+        std::lock_guard<std::mutex> lk(state->m);
+        for (auto const &slot : state->slots)
+            if (slot.busy && now - slot.started >= threshold)
+                result.push_back(background_task_info{slot.name, now - slot.started});
+        return result;
     }
-   
-    const std::thread &as_thread() const noexcept {
-        return t;
+
+    std::size_t thread_count() const
+    {
+        std::lock_guard<std::mutex> lk(state->m);
+        return state->threads.size();
     }
 };
 
-void do_work(uint8_t id);
+// edit_document from 2.1.4, with the detach() replaced by the supervisor
 
-void f() {
-    std::vector<std::thread> threads;
-    for (uint8_t i = 0; i < 20; ++i)
+background_supervisor &document_supervisor()
+{
+    static background_supervisor supervisor(8);
+    return supervisor;
+}
+
+void edit_document_supervised(std::string const &filename, std::stop_token stop)
+{
+    open_document_and_display_gui(filename);
+
+    while (!done_editing() && !stop.stop_requested())
     {
-        threads.emplace_back(do_work, i);
+        user_command cmd = get_user_input();
+
+        if (cmd.type == open_new_document)
+        {
+            std::string const new_name = get_filename_from_user();
+            document_supervisor().launch("edit " + new_name, [new_name](std::stop_token stop) {
+                edit_document_supervised(new_name, stop);
+            });
+        }
+        else
+        {
+            process_user_input();
+        }
     }
-    for (auto &entry : threads)
-        entry.join();
 }
 
-
 /* **************************************************************************************** */
 
 /*** 2.4 Choosing the number of threads at runtime 
@@ -382,51 +568,19 @@ void f() {
  * the no of CPU Cores. If there is no info, it returns 0
 */
 
-// A naïve parallel version of std::accumulate
+// accumulate_block and the parallel_accumulate overloads (2.4.1 - 2.4.3): include/parallel_accumulate.h
 
-template<typename Iterator, typename T>
-struct accumulate_block{
-    void operator() (Iterator first, Iterator last, T& result){
-        result = std::accumulate(first, last, result);
-    }
-};
+// e.g. one audio frame: 4096 samples, no heap allocation and no thread per call
+std::array<float, 4096> const &next_frame();
 
-template<typename Iterator, typename T>
-T parallel_accumulate(Iterator first, Iterator last, T init){
-    unsigned long const length = std::distance(fist, last);
-    
-    if(!length)
-        return init;
-    
-    unsigned long const min_per_thread = 25;
-    unsigned long const max_threads = 
-                (length+min_per_thread-1)/min_per_thread;
-    unsigned long const hardware_threads = 
-                std::thread::hardware_concurrency();
-    unsigned long const num_thread =
-                std::min(hardware_threads != 0 ? hardware_threads:2, max_threads);
-    unsigned long const block_size = length / num_threads;
-
-    std::vector<T> result(num_threads);
-    std::vector<std::thread> threads(num_threads - 1);
-    Iterator block_start = first;
-    
-    for (unsigned long i = 0; i < (num_threads - 1); ++i)
-    {
-        Iterator block_end = block_start;
-        std::advance(block_end, block_size);
-        threads[i] = std::thread(
-            accumulate_block<Iterator, T>(),
-            block_start, block_end, std::ref(results[i]));
-        block_start = block_end;
-    }
-    accumulate_block<Iterator, T>()(
-        block_start, last, results[num_threads - 1]);
-    for (auto &entry : threads)
-        entry.join();
-    return std::accumulate(results.begin(), results.end(), init);
+float frame_total()
+{
+    std::array<float, 4096> const &frame = next_frame();
+    return parallel_accumulate(frame, 0.0f);
 }
 
+static_assert(parallel_accumulate(std::array<int, 4>{1, 2, 3, 4}, 0) == 10);
+static_assert(parallel_accumulate(std::array<long, 1000>{}, 5L) == 5);
 
 /**2.5 Identifying threads */
 std::thread::id master_thread;
@@ -0,0 +1,350 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*** 5.3.3 Relaxed ordering: a sharded counter
+ *
+ * struct func from 2.1.1 hammers do_something(i) on one shared int &i. With several threads
+ * that's a data race; with a std::atomic<int> it's correct, but every increment takes the
+ * same cache line exclusive, so the threads take turns instead of running in parallel.
+ *
+ * sharded_counter<T> spreads the count over shards, each on its own cache line:
+ *
+ *  - a thread gets a shard index the first time it touches any sharded_counter (round
+ *    robin), so with no more threads than shards nobody shares a line
+ *  - add() is a relaxed fetch_add on the calling thread's shard: nothing else is ordered by
+ *    a counter, so there's no reason to pay for more
+ *  - load() sums the shards. It's not a snapshot, increments racing with it may or may not
+ *    be included, but once the writers are joined it's exact
+ *
+ * Reads cost one load per shard, so this is for counters written far more often than read
+ * (metrics, statistics), not for values used to make decisions.
+*/
+
+constexpr std::size_t counter_cache_line = 64;
+
+inline unsigned this_thread_shard_index() noexcept
+{
+    static std::atomic<unsigned> next_index{0};
+    thread_local unsigned const index = next_index.fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+template <typename T>
+class sharded_counter
+{
+    static_assert(std::is_integral_v<T>, "fetch_add on floating point atomics isn't lock-free everywhere");
+
+    struct alignas(counter_cache_line) shard
+    {
+        std::atomic<T> value{0};
+    };
+
+    std::size_t mask; // shard count - 1, a power of two
+    std::unique_ptr<shard[]> shards;
+
+    static std::size_t default_shard_count() noexcept
+    {
+        unsigned const hardware_threads = std::thread::hardware_concurrency();
+        return hardware_threads != 0 ? hardware_threads : 2;
+    }
+
+public:
+    explicit sharded_counter(std::size_t shard_count = default_shard_count())
+        : mask(std::bit_ceil(std::max<std::size_t>(shard_count, 1)) - 1),
+          shards(new shard[mask + 1])
+    {}
+
+    sharded_counter(sharded_counter const &) = delete;
+    sharded_counter &operator=(sharded_counter const &) = delete;
+
+    void add(T delta) noexcept
+    {
+        shards[this_thread_shard_index() & mask].value.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    sharded_counter &operator+=(T delta) noexcept
+    {
+        add(delta);
+        return *this;
+    }
+
+    sharded_counter &operator++() noexcept
+    {
+        add(1);
+        return *this;
+    }
+
+    T load() const noexcept
+    {
+        T total = 0;
+        for (std::size_t i = 0; i <= mask; ++i)
+            total += shards[i].value.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    operator T() const noexcept
+    {
+        return load();
+    }
+
+    // Not atomic as a whole: increments racing with reset() can survive it
+    void reset() noexcept
+    {
+        for (std::size_t i = 0; i <= mask; ++i)
+            shards[i].value.store(0, std::memory_order_relaxed);
+    }
+
+    std::size_t shard_count() const noexcept
+    {
+        return mask + 1;
+    }
+};
+
+// func from 2.1.1 with the shared int & replaced: any number of these can run at once
+
+void do_something(sharded_counter<long> &counter)
+{
+    ++counter;
+}
+
+struct counting_func
+{
+    sharded_counter<long> &counter;
+    counting_func(sharded_counter<long> &counter_) : counter(counter_) {}
+
+    void operator()()
+    {
+        for (unsigned j = 0; j < 1000000; ++j)
+            do_something(counter);
+    }
+};
+
+long count_in_parallel(unsigned thread_count)
+{
+    sharded_counter<long> counter;
+    {
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < thread_count; ++i)
+            threads.emplace_back(counting_func(counter));
+        for (auto &entry : threads)
+            entry.join();
+    }
+    return counter.load(); // thread_count * 1000000: the joins order every increment before this
+}
+
+/* **************************************************************************************** */
+
+/*** 5.3.3 Seqlocks and double buffers: readers that never wait for the writer
+ *
+ * oops_again from 2.2 hands widget_data to update_data_for_widget with std::ref, then has
+ * to join() before process_widget_data(data) may look at it: production and consumption
+ * take turns. Two ways to let readers see the last complete update at any time instead:
+ *
+ * seqlock<T>, for small trivially copyable T (a status block, a few counters):
+ *
+ *  - one writer: sequence goes odd, the bytes are written, sequence goes even again
+ *  - a reader copies the bytes and retries if it saw an odd sequence or the sequence
+ *    changed underneath it; the writer never waits for readers
+ *  - the bytes are kept in relaxed atomic words, so a torn read is detected and retried,
+ *    never a data race
+ *
+ * double_buffer<T>, for anything else (vectors, strings):
+ *
+ *  - the writer fills back() and publish() makes it the front with one atomic store
+ *  - read() registers on the front buffer and returns a snapshot handle; the buffer never
+ *    changes while a snapshot holds it. Readers never wait for the writer
+ *  - publish() then takes any buffer no reader holds as the next back(). There are three,
+ *    so that's the previous front or the spare; only when readers hold both does the writer
+ *    wait. Keep snapshots short-lived
+ *  - no allocation after construction; back() holds stale data, the writer overwrites it
+*/
+
+template <typename T>
+class seqlock
+{
+    static_assert(std::is_trivially_copyable_v<T>, "seqlock copies T as raw bytes");
+
+    using word = std::uintptr_t;
+    static constexpr std::size_t word_count = (sizeof(T) + sizeof(word) - 1) / sizeof(word);
+
+    std::atomic<std::uint64_t> sequence{0};
+    std::array<std::atomic<word>, word_count> words{};
+
+public:
+    seqlock() : seqlock(T()) {}
+
+    explicit seqlock(T const &initial)
+    {
+        store(initial);
+    }
+
+    seqlock(seqlock const &) = delete;
+    seqlock &operator=(seqlock const &) = delete;
+
+    // Single writer: concurrent store() calls need their own lock
+    void store(T const &value) noexcept
+    {
+        std::array<word, word_count> raw{};
+        std::memcpy(raw.data(), &value, sizeof(T));
+
+        std::uint64_t const seq = sequence.load(std::memory_order_relaxed);
+        sequence.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release); // odd before any word
+        for (std::size_t i = 0; i < word_count; ++i)
+            words[i].store(raw[i], std::memory_order_relaxed);
+        sequence.store(seq + 2, std::memory_order_release);
+    }
+
+    T load() const noexcept
+    {
+        std::array<word, word_count> raw;
+        for (;;)
+        {
+            std::uint64_t const before = sequence.load(std::memory_order_acquire);
+            if (before & 1)
+            {
+                std::this_thread::yield(); // mid-write
+                continue;
+            }
+            for (std::size_t i = 0; i < word_count; ++i)
+                raw[i] = words[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire); // words before the re-check
+            if (sequence.load(std::memory_order_relaxed) == before)
+                break;
+        }
+        T value;
+        std::memcpy(&value, raw.data(), sizeof(T));
+        return value;
+    }
+};
+
+template <typename T>
+class double_buffer
+{
+    struct alignas(counter_cache_line) slot
+    {
+        T value;
+        mutable std::atomic<unsigned> readers{0};
+    };
+
+    std::array<slot, 3> slots;
+    std::atomic<unsigned> front{0};
+    unsigned back_index = 1; // writer only
+
+public:
+    class snapshot
+    {
+        slot const *held;
+
+    public:
+        explicit snapshot(slot const &held_) noexcept : held(&held_) {}
+        snapshot(snapshot &&other) noexcept : held(std::exchange(other.held, nullptr)) {}
+        snapshot &operator=(snapshot &&) = delete;
+
+        ~snapshot()
+        {
+            if (held)
+                held->readers.fetch_sub(1, std::memory_order_release);
+        }
+
+        T const &operator*() const noexcept { return held->value; }
+        T const *operator->() const noexcept { return &held->value; }
+    };
+
+    double_buffer() = default;
+
+    explicit double_buffer(T const &initial)
+    {
+        for (auto &entry : slots)
+            entry.value = initial;
+    }
+
+    double_buffer(double_buffer const &) = delete;
+    double_buffer &operator=(double_buffer const &) = delete;
+
+    // Writer side only
+    T &back() noexcept
+    {
+        return slots[back_index].value;
+    }
+
+    void publish()
+    {
+        unsigned const published = back_index;
+        front.store(published, std::memory_order_seq_cst);
+        for (;;)
+        {
+            for (unsigned i = 0; i < slots.size(); ++i) // acquire: after the last reader's release
+                if (i != published && slots[i].readers.load(std::memory_order_seq_cst) == 0)
+                {
+                    back_index = i;
+                    return;
+                }
+            std::this_thread::yield(); // readers hold both other slots
+        }
+    }
+
+    // Lock-free: retries only if a publish() happened in between
+    snapshot read() const
+    {
+        for (;;)
+        {
+            unsigned const i = front.load(std::memory_order_seq_cst);
+            slots[i].readers.fetch_add(1, std::memory_order_seq_cst);
+            if (front.load(std::memory_order_seq_cst) == i)
+                return snapshot(slots[i]); // publish() can't pick i as its back buffer now
+            slots[i].readers.fetch_sub(1, std::memory_order_release);
+        }
+    }
+};
+
+// oops_again from 2.2 without the join in the middle: the updater publishes, the readers
+// look at the newest snapshot whenever they poll
+
+struct widget_status // small and trivially copyable: seqlock
+{
+    std::uint64_t version;
+    double progress;
+    std::uint32_t items;
+};
+
+struct widget_contents // owns heap memory: double_buffer
+{
+    std::vector<std::string> lines;
+};
+
+void update_data_for_widget(unsigned widget, widget_contents &data); // fills data completely
+void process_widget_data(widget_contents const &data);
+void display_status(widget_status const &status);
+
+void update_widget_continuously(unsigned widget, std::stop_token stop,
+                                double_buffer<widget_contents> &contents,
+                                seqlock<widget_status> &status)
+{
+    for (std::uint64_t version = 1; !stop.stop_requested(); ++version)
+    {
+        update_data_for_widget(widget, contents.back());
+        std::uint32_t const items = static_cast<std::uint32_t>(contents.back().lines.size());
+        contents.publish();
+        status.store(widget_status{version, 1.0, items});
+    }
+}
+
+void poll_widget(double_buffer<widget_contents> const &contents, seqlock<widget_status> const &status)
+{
+    display_status(status.load());                          // never blocks on the updater
+    auto const latest = contents.read();
+    process_widget_data(*latest);                           // unchanged until latest goes away
+}
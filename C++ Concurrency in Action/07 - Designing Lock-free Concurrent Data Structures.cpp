@@ -0,0 +1,575 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*** 7.2 Bounded multi-producer/multi-consumer queue
+ *
+ * edit_document from 2.1.4 detaches a new thread for every open_new_document, so a burst of
+ * opens is a burst of threads and nothing pushes back. A fixed set of workers fed by a
+ * bounded queue caps both the thread count and the memory used by pending work.
+ *
+ * mpmc_bounded_queue is Dmitry Vyukov's bounded MPMC queue:
+ *
+ *  - a ring of cells, each with a sequence number saying whose turn it is
+ *  - a producer claims enqueue_pos with a CAS when cell.sequence == pos, writes the value,
+ *    then publishes it with sequence = pos + 1
+ *  - a consumer claims dequeue_pos when cell.sequence == pos + 1, and frees the cell for
+ *    the next lap with sequence = pos + capacity
+ *  - no locks, and producers only contend with producers, consumers with consumers
+ *    (the two positions live on separate cache lines)
+ *
+ * capacity must be a power of two. try_push() only moves from value once it owns a cell,
+ * so on failure the caller still has it.
+*/
+
+constexpr std::size_t queue_cache_line = 64;
+
+template <typename T>
+class mpmc_bounded_queue
+{
+    struct cell
+    {
+        std::atomic<std::size_t> sequence;
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T *value() { return std::launder(reinterpret_cast<T *>(storage)); }
+    };
+
+    std::unique_ptr<cell[]> const buffer;
+    std::size_t const mask;
+    alignas(queue_cache_line) std::atomic<std::size_t> enqueue_pos;
+    alignas(queue_cache_line) std::atomic<std::size_t> dequeue_pos;
+
+public:
+    explicit mpmc_bounded_queue(std::size_t capacity)
+        : buffer(new cell[capacity]), mask(capacity - 1), enqueue_pos(0), dequeue_pos(0)
+    {
+        if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+            throw std::invalid_argument("mpmc_bounded_queue capacity must be a power of two");
+        for (std::size_t i = 0; i != capacity; ++i)
+            buffer[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    ~mpmc_bounded_queue()
+    {
+        T discarded{};
+        while (try_pop(discarded))
+        {}
+    }
+
+    mpmc_bounded_queue(mpmc_bounded_queue const &) = delete;
+    mpmc_bounded_queue &operator=(mpmc_bounded_queue const &) = delete;
+
+    std::size_t capacity() const noexcept
+    {
+        return mask + 1;
+    }
+
+    template <typename U>
+    bool try_push(U &&value)
+    {
+        cell *c;
+        std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            c = &buffer[pos & mask];
+            std::size_t const seq = c->sequence.load(std::memory_order_acquire);
+            std::intptr_t const diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false; // full: the cell still holds last lap's value
+            }
+            else
+            {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        new (c->storage) T(std::forward<U>(value)); // if this throws the cell is lost, keep T's move noexcept
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T &result)
+    {
+        cell *c;
+        std::size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            c = &buffer[pos & mask];
+            std::size_t const seq = c->sequence.load(std::memory_order_acquire);
+            std::intptr_t const diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false; // empty
+            }
+            else
+            {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        T *stored = c->value();
+        result = std::move(*stored);
+        stored->~T();
+        c->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+/* **************************************************************************************** */
+
+/** A fixed set of document workers
+ *
+ * edit_document_with_workers() below queues new documents instead of detaching a thread
+ * for each one. What happens when the queue is full is the caller's choice:
+ *
+ *  - block: wait until a worker frees a slot (backpressure on the UI thread)
+ *  - drop: open() returns false and the document isn't opened
+ *  - run_on_caller: the opening thread handles the document itself, which also slows down
+ *    whoever is producing the opens
+ *
+ * Idle workers and blocked producers sleep on C++20 atomic wait/notify on the push and pop
+ * counters, not on a mutex. The destructor lets the workers drain what's queued.
+*/
+
+enum class full_queue_policy
+{
+    block,
+    drop,
+    run_on_caller
+};
+
+class document_workers
+{
+    mpmc_bounded_queue<std::string> queue;
+    std::function<void(std::string const &)> handler;
+    full_queue_policy const policy;
+    std::atomic<bool> done;
+    std::atomic<std::uint32_t> pushes;
+    std::atomic<std::uint32_t> pops;
+    std::vector<std::thread> workers;
+
+    void worker_thread()
+    {
+        std::string name;
+        for (;;)
+        {
+            std::uint32_t const seen = pushes.load(std::memory_order_acquire);
+            if (queue.try_pop(name))
+            {
+                pops.fetch_add(1, std::memory_order_release);
+                pops.notify_one();
+                handler(name);
+                continue;
+            }
+            if (done.load(std::memory_order_acquire))
+                return;
+            pushes.wait(seen, std::memory_order_acquire);
+        }
+    }
+
+public:
+    document_workers(std::size_t capacity, unsigned worker_count, full_queue_policy policy_,
+                     std::function<void(std::string const &)> handler_)
+        : queue(capacity), handler(std::move(handler_)), policy(policy_),
+          done(false), pushes(0), pops(0)
+    {
+        try
+        {
+            for (unsigned i = 0; i < worker_count; ++i)
+                workers.emplace_back(&document_workers::worker_thread, this);
+        }
+        catch (...)
+        {
+            shut_down();
+            throw;
+        }
+    }
+
+    ~document_workers()
+    {
+        shut_down();
+    }
+
+    document_workers(document_workers const &) = delete;
+    document_workers &operator=(document_workers const &) = delete;
+
+    void shut_down()
+    {
+        done.store(true, std::memory_order_release);
+        pushes.fetch_add(1, std::memory_order_release);
+        pushes.notify_all();
+        for (auto &entry : workers)
+            if (entry.joinable())
+                entry.join();
+    }
+
+    // false only with full_queue_policy::drop
+    bool open(std::string name)
+    {
+        for (;;)
+        {
+            std::uint32_t const seen = pops.load(std::memory_order_acquire);
+            if (queue.try_push(std::move(name))) // moved from only once a cell is claimed
+            {
+                pushes.fetch_add(1, std::memory_order_release);
+                pushes.notify_one();
+                return true;
+            }
+            switch (policy)
+            {
+            case full_queue_policy::drop:
+                return false;
+            case full_queue_policy::run_on_caller:
+                handler(name);
+                return true;
+            case full_queue_policy::block:
+                pops.wait(seen, std::memory_order_acquire);
+                break;
+            }
+        }
+    }
+};
+
+// 2.1.4's edit_document, with the detach replaced by a queue hand-off
+
+void edit_document_with_workers(document_workers &workers, std::string const &filename)
+{
+    open_document_and_display_gui(filename);
+
+    while (!done_editing())
+    {
+        user_command cmd = get_user_input();
+
+        if (cmd.type == open_new_document)
+        {
+            std::string const new_name = get_filename_from_user();
+            workers.open(new_name);
+        }
+        else
+        {
+            process_user_input();
+        }
+    }
+}
+
+/*
+    document_workers workers(64, 4, full_queue_policy::run_on_caller,
+        [&workers](std::string const &name) { edit_document_with_workers(workers, name); });
+
+    Not block here: documents are opened from inside the handler, and workers that block on
+    their own full queue can't make progress.
+*/
+
+/* **************************************************************************************** */
+
+/*** 7.3 Asynchronous logging with per-thread SPSC rings
+ *
+ * hello() and main() in "01 - Intro to Concurrency.cpp" write to std::cout. Every << takes
+ * the stream's lock and sooner or later a write() syscall, so threads that log a lot end up
+ * queueing behind each other on that lock.
+ *
+ * async_logger:
+ *
+ *  - each logging thread gets its own single-producer/single-consumer ring of fixed-size
+ *    records; log() copies the text into the next free record and bumps head, no lock and
+ *    no allocation (the only lock is taken once per thread and logger, to register its ring)
+ *  - a thread keeps one cached ring per logger it writes to, so alternating between loggers
+ *    doesn't allocate; entries of destroyed loggers are dropped on the next new registration
+ *  - one writer thread walks all rings and hands runs of records straight to writev(), up
+ *    to IOV_MAX records per syscall
+ *  - memory is bounded: ring_capacity records per thread. When a ring is full, drop counts
+ *    the record in dropped_records(), block spins (yielding) until the writer catches up
+ *  - records longer than a slot are truncated
+ *  - order is kept per thread, not across threads
+ *  - rings of exited threads are flushed, then released; the destructor flushes everything
+ *
+ * "01 - Intro to Concurrency.cpp" stays the book's first listing on purpose, std::cout and
+ * all: it is the one file meant to build with nothing but <thread>. hello_logged() and
+ * intro_logged() at the end of this section are its hello() and main() on console_log().
+*/
+
+class spsc_record_ring
+{
+public:
+    static constexpr std::size_t record_size = 256;
+
+    struct record
+    {
+        std::uint32_t length;
+        char text[record_size - sizeof(std::uint32_t)];
+    };
+
+private:
+    std::unique_ptr<record[]> const records;
+    std::size_t const mask;
+    alignas(queue_cache_line) std::atomic<std::size_t> head; // written by the producer
+    std::size_t cached_tail;                                 // producer's view of tail
+    alignas(queue_cache_line) std::atomic<std::size_t> tail; // written by the consumer
+
+public:
+    explicit spsc_record_ring(std::size_t capacity) // power of two
+        : records(new record[capacity]), mask(capacity - 1), head(0), cached_tail(0), tail(0)
+    {}
+
+    // producer: next free record, or nullptr if full
+    record *try_reserve()
+    {
+        std::size_t const h = head.load(std::memory_order_relaxed);
+        if (h - cached_tail > mask)
+        {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (h - cached_tail > mask)
+                return nullptr;
+        }
+        return &records[h & mask];
+    }
+
+    // producer: publish the record returned by try_reserve()
+    void commit()
+    {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // consumer: [first, first + count) are readable
+    std::size_t readable(std::size_t &first) const
+    {
+        first = tail.load(std::memory_order_relaxed);
+        return head.load(std::memory_order_acquire) - first;
+    }
+
+    record &at(std::size_t index)
+    {
+        return records[index & mask];
+    }
+
+    // consumer: hand count records back to the producer
+    void release(std::size_t count)
+    {
+        tail.store(tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+};
+
+enum class log_full_policy
+{
+    drop,
+    block
+};
+
+class async_logger
+{
+    int const fd;
+    std::size_t const ring_capacity;
+    log_full_policy const policy;
+    std::chrono::microseconds const idle_wait;
+    std::uint64_t const id;
+    std::shared_ptr<void> const alive = std::make_shared<char>(); // expires with the logger
+
+    std::mutex registry_mutex;
+    std::vector<std::shared_ptr<spsc_record_ring>> rings;
+    std::atomic<bool> done;
+    std::atomic<std::uint64_t> dropped;
+    std::thread writer;
+
+    static std::uint64_t next_id()
+    {
+        static std::atomic<std::uint64_t> ids{0};
+        return ++ids;
+    }
+
+    spsc_record_ring &local_ring()
+    {
+        struct cached_ring
+        {
+            std::uint64_t owner;
+            std::weak_ptr<void> logger;
+            std::shared_ptr<spsc_record_ring> ring;
+        };
+        thread_local std::vector<cached_ring> cache; // one entry per logger; usually just one
+
+        for (auto const &entry : cache)
+            if (entry.owner == id)
+                return *entry.ring;
+
+        std::erase_if(cache, [](cached_ring const &entry) { return entry.logger.expired(); });
+        auto ring = std::make_shared<spsc_record_ring>(ring_capacity);
+        {
+            std::lock_guard<std::mutex> lk(registry_mutex);
+            rings.push_back(ring);
+        }
+        cache.push_back(cached_ring{id, alive, ring});
+        return *ring;
+    }
+
+    void write_all(iovec *iov, int count)
+    {
+        while (count > 0)
+        {
+            ssize_t written = ::writev(fd, iov, count);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return; // nowhere to report it; the records are dropped
+            }
+            while (count > 0 && static_cast<std::size_t>(written) >= iov->iov_len)
+            {
+                written -= static_cast<ssize_t>(iov->iov_len);
+                ++iov;
+                --count;
+            }
+            if (count > 0) // partial write inside a record
+            {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+                iov->iov_len -= static_cast<std::size_t>(written);
+            }
+        }
+    }
+
+    bool flush(spsc_record_ring &ring)
+    {
+        static constexpr int max_iov = IOV_MAX < 1024 ? IOV_MAX : 1024;
+        iovec iov[max_iov];
+        bool wrote = false;
+
+        std::size_t first;
+        while (std::size_t const available = ring.readable(first))
+        {
+            int const count = static_cast<int>(std::min<std::size_t>(available, max_iov));
+            for (int i = 0; i < count; ++i)
+            {
+                spsc_record_ring::record &r = ring.at(first + i);
+                iov[i].iov_base = r.text;
+                iov[i].iov_len = r.length;
+            }
+            write_all(iov, count);
+            ring.release(count);
+            wrote = true;
+        }
+        return wrote;
+    }
+
+    void writer_thread()
+    {
+        std::vector<std::shared_ptr<spsc_record_ring>> snapshot;
+        for (;;)
+        {
+            bool const stopping = done.load(std::memory_order_acquire);
+            {
+                std::lock_guard<std::mutex> lk(registry_mutex);
+                snapshot.assign(rings.begin(), rings.end());
+            }
+
+            bool wrote = false;
+            for (auto &ring : snapshot)
+                wrote = flush(*ring) || wrote;
+            snapshot.clear();
+
+            {
+                std::lock_guard<std::mutex> lk(registry_mutex);
+                std::size_t first;
+                rings.erase(std::remove_if(rings.begin(), rings.end(),
+                                           [&first](auto const &ring) { // owner thread has exited
+                                               return ring.use_count() == 1 && ring->readable(first) == 0;
+                                           }),
+                            rings.end());
+            }
+
+            if (stopping)
+                return; // everything logged before done was set has been written
+            if (!wrote)
+                std::this_thread::sleep_for(idle_wait);
+        }
+    }
+
+public:
+    explicit async_logger(int fd_ = STDOUT_FILENO, std::size_t ring_capacity_ = 1024,
+                          log_full_policy policy_ = log_full_policy::drop,
+                          std::chrono::microseconds idle_wait_ = std::chrono::microseconds(500))
+        : fd(fd_), ring_capacity(ring_capacity_), policy(policy_), idle_wait(idle_wait_),
+          id(next_id()), done(false), dropped(0),
+          writer(&async_logger::writer_thread, this)
+    {}
+
+    ~async_logger()
+    {
+        done.store(true, std::memory_order_release);
+        writer.join();
+    }
+
+    async_logger(async_logger const &) = delete;
+    async_logger &operator=(async_logger const &) = delete;
+
+    void log(std::string_view text)
+    {
+        spsc_record_ring &ring = local_ring();
+        spsc_record_ring::record *r = ring.try_reserve();
+        while (!r)
+        {
+            if (policy == log_full_policy::drop)
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            std::this_thread::yield();
+            r = ring.try_reserve();
+        }
+        std::size_t const length = std::min(text.size(), sizeof(r->text));
+        std::memcpy(r->text, text.data(), length);
+        r->length = static_cast<std::uint32_t>(length);
+        ring.commit();
+    }
+
+    std::uint64_t dropped_records() const noexcept
+    {
+        return dropped.load(std::memory_order_relaxed);
+    }
+};
+
+// hello() and main() from chapter 1, logging instead of writing to std::cout
+
+async_logger &console_log()
+{
+    static async_logger logger;
+    return logger;
+}
+
+void hello_logged()
+{
+    console_log().log("Hello from thread\n");
+}
+
+void intro_logged()
+{
+    console_log().log("Hello from Clang!\n");
+
+    std::thread t(hello_logged);
+    t.join();
+}
@@ -0,0 +1,332 @@
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "include/deterministic_accumulate.h"
+#include "include/join_threads.h"
+
+// 8.4.2 join_threads: include/join_threads.h
+
+/* **************************************************************************************** */
+
+/*** 8.5 parallel_reduce and parallel_transform_reduce
+ *
+ * parallel_accumulate is hard-wired to operator+ and a serial std::accumulate over results.
+ * Same block decomposition, but:
+ *
+ *  - any associative reduce_op; init is only combined once, at the very end, so it doesn't
+ *    have to be an identity (each block starts from its own first element)
+ *  - transform_op is applied element by element inside the block, so sum of squares never
+ *    materializes a vector of squares
+ *  - partials are combined as a binary tree while the blocks finish: block i absorbs
+ *    block i + 1, i + 2, i + 4... as long as i is a left child, so the combine is
+ *    log2(num_blocks) deep and overlaps with slower blocks instead of waiting for all of them
+ *  - left-to-right order is kept, reduce_op doesn't need to be commutative
+ *  - an exception in any block travels up the tree and is rethrown by the caller
+*/
+
+namespace detail
+{
+    template <typename T>
+    struct reduce_slot
+    {
+        std::optional<T> value;
+        std::exception_ptr error;
+        std::atomic<bool> ready{false};
+    };
+
+    template <typename Iterator, typename T, typename ReduceOp, typename TransformOp>
+    void reduce_block_into_tree(std::vector<reduce_slot<T>> &slots, unsigned long index,
+                                Iterator first, Iterator last,
+                                ReduceOp &reduce_op, TransformOp &transform_op)
+    {
+        reduce_slot<T> &slot = slots[index];
+        try
+        {
+            T partial = transform_op(*first);
+            for (++first; first != last; ++first)
+                partial = reduce_op(std::move(partial), transform_op(*first));
+
+            for (unsigned long step = 1;
+                 index % (2 * step) == 0 && index + step < slots.size(); step *= 2)
+            {
+                reduce_slot<T> &right = slots[index + step];
+                right.ready.wait(false, std::memory_order_acquire);
+                if (right.error)
+                    std::rethrow_exception(right.error);
+                partial = reduce_op(std::move(partial), std::move(*right.value));
+            }
+            slot.value.emplace(std::move(partial));
+        }
+        catch (...)
+        {
+            slot.error = std::current_exception();
+        }
+        slot.ready.store(true, std::memory_order_release);
+        slot.ready.notify_one();
+    }
+}
+
+template <typename Iterator, typename T, typename ReduceOp, typename TransformOp>
+T parallel_transform_reduce(Iterator first, Iterator last, T init,
+                            ReduceOp reduce_op, TransformOp transform_op)
+{
+    unsigned long const length = std::distance(first, last);
+
+    if (!length)
+        return init;
+
+    unsigned long const min_per_thread = 25;
+    unsigned long const max_threads =
+        (length + min_per_thread - 1) / min_per_thread;
+    unsigned long const hardware_threads =
+        std::thread::hardware_concurrency();
+    unsigned long const num_threads =
+        std::min(hardware_threads != 0 ? hardware_threads : 2, max_threads);
+    unsigned long const block_size = length / num_threads;
+
+    std::vector<detail::reduce_slot<T>> slots(num_threads);
+    std::vector<std::thread> threads(num_threads - 1);
+
+    {
+        join_threads joiner(threads);
+
+        // block 0 is the root of the tree, so the calling thread takes it
+        Iterator const first_block_end = std::next(first, block_size);
+        Iterator block_start = first_block_end;
+        unsigned long i = 1;
+        try
+        {
+            for (; i < num_threads; ++i)
+            {
+                Iterator block_end = block_start;
+                if (i == num_threads - 1)
+                    block_end = last;
+                else
+                    std::advance(block_end, block_size);
+                threads[i - 1] = std::thread([&slots, &reduce_op, &transform_op, i, block_start, block_end] {
+                    detail::reduce_block_into_tree<Iterator, T>(slots, i, block_start, block_end,
+                                                               reduce_op, transform_op);
+                });
+                block_start = block_end;
+            }
+        }
+        catch (...)
+        {
+            for (; i < num_threads; ++i) // running blocks may be waiting on these
+            {
+                slots[i].error = std::current_exception();
+                slots[i].ready.store(true, std::memory_order_release);
+                slots[i].ready.notify_one();
+            }
+            throw;
+        }
+        detail::reduce_block_into_tree<Iterator, T>(slots, 0, first, first_block_end,
+                                                   reduce_op, transform_op);
+    }
+
+    if (slots[0].error)
+        std::rethrow_exception(slots[0].error);
+    return reduce_op(std::move(init), std::move(*slots[0].value));
+}
+
+template <typename Iterator, typename T, typename ReduceOp>
+T parallel_reduce(Iterator first, Iterator last, T init, ReduceOp reduce_op)
+{
+    return parallel_transform_reduce(
+        first, last, std::move(init), reduce_op,
+        [](auto const &element) -> T { return element; });
+}
+
+template <typename Iterator, typename T>
+T parallel_reduce(Iterator first, Iterator last, T init)
+{
+    return parallel_reduce(first, last, std::move(init), std::plus<>());
+}
+
+// e.g. sum of squares without a temporary vector of squares
+template <typename Iterator>
+double parallel_sum_of_squares(Iterator first, Iterator last)
+{
+    return parallel_transform_reduce(
+        first, last, 0.0, std::plus<>(),
+        [](auto const &x) { return static_cast<double>(x) * x; });
+}
+
+/* **************************************************************************************** */
+
+/*** 8.5.3 parallel_inclusive_scan and parallel_exclusive_scan
+ *
+ * Running sums (std::partial_sum, std::inclusive_scan) look inherently serial: element i
+ * depends on element i - 1. With the same block split as parallel_accumulate it takes
+ * three steps:
+ *
+ *  1. each thread reduces its block to a single total (read only)
+ *  2. the totals are scanned serially, giving each block its starting carry; there are
+ *     only num_threads of them, so this is the barrier's completion step
+ *  3. each thread scans its block again, starting from its carry, and writes the output
+ *
+ * Step 1 only reads, so d_first == first (the in-place overloads) works: every element is
+ * read before it's overwritten. The cost is reading the input twice; in exchange no
+ * temporary buffer is needed and step 3 has no extra fix-up pass over the output.
+ * op must be associative. Random-access iterators only.
+*/
+
+namespace detail
+{
+    template <typename InputIt, typename OutputIt, typename T, typename BinaryOp>
+    OutputIt parallel_scan(InputIt first, InputIt last, OutputIt d_first,
+                           std::optional<T> init, BinaryOp op, bool inclusive)
+    {
+        unsigned long const length = last - first;
+
+        if (!length)
+            return d_first;
+
+        unsigned long const min_per_thread = 25;
+        unsigned long const max_threads =
+            (length + min_per_thread - 1) / min_per_thread;
+        unsigned long const hardware_threads =
+            std::thread::hardware_concurrency();
+        unsigned long const num_threads =
+            std::min(hardware_threads != 0 ? hardware_threads : 2, max_threads);
+        unsigned long const block_size = length / num_threads;
+
+        std::vector<std::optional<T>> totals(num_threads);
+        std::vector<std::optional<T>> carries(num_threads);
+        std::vector<std::exception_ptr> errors(num_threads + 1);
+        std::atomic<bool> failed(false);
+
+        auto scan_totals = [&]() noexcept {
+            if (failed.load())
+                return;
+            try
+            {
+                std::optional<T> running = init;
+                for (unsigned long i = 0; i < num_threads; ++i)
+                {
+                    carries[i] = running;
+                    running = running ? op(*running, *totals[i]) : *totals[i];
+                }
+            }
+            catch (...)
+            {
+                errors[num_threads] = std::current_exception();
+                failed = true;
+            }
+        };
+        std::barrier sync(static_cast<std::ptrdiff_t>(num_threads), scan_totals);
+
+        auto run_block = [&](unsigned long i) {
+            InputIt const block_first = first + i * block_size;
+            InputIt const block_last = i == num_threads - 1 ? last : block_first + block_size;
+            try
+            {
+                T total = *block_first;
+                for (InputIt it = std::next(block_first); it != block_last; ++it)
+                    total = op(total, *it);
+                totals[i] = std::move(total);
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+                failed = true;
+            }
+
+            sync.arrive_and_wait();
+            if (failed.load())
+                return;
+
+            try
+            {
+                OutputIt out = d_first + (block_first - first);
+                std::optional<T> acc = carries[i];
+                for (InputIt it = block_first; it != block_last; ++it, ++out)
+                {
+                    T x = *it; // read before the write: out may alias it
+                    if (inclusive)
+                    {
+                        acc = acc ? op(*acc, std::move(x)) : std::move(x);
+                        *out = *acc;
+                    }
+                    else
+                    {
+                        *out = *acc;
+                        acc = op(*acc, std::move(x));
+                    }
+                }
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+                failed = true;
+            }
+        };
+
+        std::vector<std::thread> threads(num_threads - 1);
+        {
+            join_threads joiner(threads);
+            unsigned long i = 1;
+            try
+            {
+                for (; i < num_threads; ++i)
+                    threads[i - 1] = std::thread(run_block, i);
+            }
+            catch (...)
+            {
+                failed = true;
+                for (; i < num_threads; ++i) // stand in for the threads that never started
+                    sync.arrive_and_drop();
+                sync.arrive_and_drop();
+                throw;
+            }
+            run_block(0);
+        }
+
+        for (auto const &error : errors)
+            if (error)
+                std::rethrow_exception(error);
+        return d_first + length;
+    }
+}
+
+template <typename InputIt, typename OutputIt, typename BinaryOp = std::plus<>>
+OutputIt parallel_inclusive_scan(InputIt first, InputIt last, OutputIt d_first,
+                                 BinaryOp op = BinaryOp())
+{
+    using T = typename std::iterator_traits<InputIt>::value_type;
+    return detail::parallel_scan(first, last, d_first, std::optional<T>(), op, true);
+}
+
+template <typename InputIt, typename OutputIt, typename T, typename BinaryOp = std::plus<>>
+OutputIt parallel_exclusive_scan(InputIt first, InputIt last, OutputIt d_first, T init,
+                                 BinaryOp op = BinaryOp())
+{
+    return detail::parallel_scan(first, last, d_first, std::optional<T>(std::move(init)), op, false);
+}
+
+// in place: the output overwrites the input
+
+template <typename Iterator, typename BinaryOp = std::plus<>>
+void parallel_inclusive_scan_in_place(Iterator first, Iterator last, BinaryOp op = BinaryOp())
+{
+    parallel_inclusive_scan(first, last, first, op);
+}
+
+template <typename Iterator, typename T, typename BinaryOp = std::plus<>>
+void parallel_exclusive_scan_in_place(Iterator first, Iterator last, T init,
+                                      BinaryOp op = BinaryOp())
+{
+    parallel_exclusive_scan(first, last, first, std::move(init), op);
+}
+
+/* **************************************************************************************** */
+
+// Deterministic floating-point reduction: include/deterministic_accumulate.h
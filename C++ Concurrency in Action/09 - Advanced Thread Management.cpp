@@ -0,0 +1,1461 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <memory_resource>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <queue>
+#include <ranges>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "include/pooled_accumulate.h"
+#include "include/thread_pool.h"
+
+// 9.1 thread_pool, function_wrapper, work_stealing_queue, cpu_topology and the scratch
+// arena: include/thread_pool.h
+
+// f() from 2.3, dispatched onto the pool instead of one std::thread per id
+
+void do_work(uint8_t id);
+
+void f_pooled(thread_pool &pool)
+{
+    std::vector<std::future<void>> results;
+    for (uint8_t i = 0; i < 20; ++i)
+    {
+        results.push_back(pool.submit(do_work, i));
+    }
+    for (auto &entry : results)
+        entry.get(); // rethrows anything do_work threw
+}
+
+// The same ids as one batch: a single handle instead of a future per id
+void f_bulk(thread_pool &pool)
+{
+    pool.submit_bulk(std::views::iota(std::uint8_t(0), std::uint8_t(20)), do_work).get();
+}
+
+// submit() with the argument checks of launch_owning() from 2.2: payloads are moved into the
+// task or shared through shared_span, never left behind as a pointer into the caller's frame
+template <typename FunctionType, typename... Args>
+auto submit_owning(thread_pool &pool, FunctionType &&f, Args &&...args)
+{
+    (detail::check_owning_argument<Args>(), ...);
+    return pool.submit(std::forward<FunctionType>(f), std::forward<Args>(args)...);
+}
+
+/** Master and worker roles
+ *
+ * some_core_part_of_algorithm from 2.5 compares std::this_thread::get_id() with a global
+ * master_thread on every call, and the master then runs its share of do_common_work inline,
+ * so master-only work waits behind common work.
+ *
+ * master_worker_scheduler gives each role its own thread(s) and queue:
+ *
+ *  - one master thread with a FIFO queue; post_to_master() is the only way onto it, so
+ *    master-only work never needs a thread id check
+ *  - a thread_pool of workers for common work; run_common() fans a body out over them
+ *  - roles live in this_thread_context (set when each thread starts), for the rare code
+ *    that still needs to ask
+*/
+
+class master_worker_scheduler
+{
+    thread_pool workers;
+    std::mutex master_mutex;
+    std::condition_variable master_work;
+    std::deque<function_wrapper> master_queue;
+    bool done = false;
+    std::thread master; // last: starts once everything above exists
+
+    void master_loop()
+    {
+        this_thread_context = execution_context{thread_role::master, 0};
+        for (;;)
+        {
+            function_wrapper task;
+            {
+                std::unique_lock<std::mutex> lk(master_mutex);
+                master_work.wait(lk, [this] { return done || !master_queue.empty(); });
+                if (master_queue.empty())
+                    return;
+                task = std::move(master_queue.front());
+                master_queue.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    explicit master_worker_scheduler(unsigned worker_count = 0)
+        : workers(pool_options{worker_count, false}),
+          master(&master_worker_scheduler::master_loop, this)
+    {}
+
+    // Runs what's already queued for the master, then the pool drains its own queues
+    ~master_worker_scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lk(master_mutex);
+            done = true;
+        }
+        master_work.notify_one();
+        master.join();
+    }
+
+    master_worker_scheduler(master_worker_scheduler const &) = delete;
+    master_worker_scheduler &operator=(master_worker_scheduler const &) = delete;
+
+    template <typename FunctionType>
+    std::future<std::invoke_result_t<std::decay_t<FunctionType>>> post_to_master(FunctionType &&f)
+    {
+        using result_type = std::invoke_result_t<std::decay_t<FunctionType>>;
+        std::packaged_task<result_type()> task(std::forward<FunctionType>(f));
+        std::future<result_type> res(task.get_future());
+        {
+            std::lock_guard<std::mutex> lk(master_mutex);
+            master_queue.emplace_back(std::move(task));
+        }
+        master_work.notify_one();
+        return res;
+    }
+
+    template <typename FunctionType, typename... Args>
+    auto submit(FunctionType &&f, Args &&...args)
+    {
+        return workers.submit(std::forward<FunctionType>(f), std::forward<Args>(args)...);
+    }
+
+    // body(i) for i in [0, count) on the workers; returns when all are done, rethrows the first
+    // failure. The caller helps if it's a worker itself.
+    template <typename Body>
+    void run_common(unsigned count, Body const &body)
+    {
+        std::vector<std::future<void>> futures;
+        futures.reserve(count);
+        for (unsigned i = 0; i < count; ++i)
+            futures.push_back(workers.submit([&body, i] { body(i); }));
+        for (auto &entry : futures) // all of them first, they reference body
+            workers.wait(entry);
+        for (auto &entry : futures)
+            entry.get();
+    }
+
+    unsigned worker_count() const noexcept
+    {
+        return workers.size();
+    }
+
+    thread_pool &worker_pool() noexcept
+    {
+        return workers;
+    }
+};
+
+void do_master_thread_work();
+void do_common_work();
+
+void some_core_part_of_algorithm(master_worker_scheduler &scheduler)
+{
+    scheduler.post_to_master(do_master_thread_work); // queued, the caller doesn't wait for it
+    scheduler.run_common(scheduler.worker_count(), [](unsigned) { do_common_work(); });
+}
+
+/** parallel_for
+ *
+ * f() from 2.3 is a hand-written parallel loop with one thread per index. When the
+ * iterations cost very different amounts, handing each thread a fixed share leaves cores
+ * idle while the slowest share finishes. parallel_for(pool, begin, end, body, schedule)
+ * runs body(i) for every i in [begin, end) on pool.size() participants (the caller is one
+ * of them), sharing out the indices in one of three ways:
+ *
+ *  - static_chunks: participant k takes chunks k, k + P, k + 2P...; by default one
+ *    contiguous block each. No shared counter at all, best for uniform iterations
+ *  - dynamic: chunks of chunk_size handed out by an atomic counter as participants ask;
+ *    evens out uneven iterations at the cost of a fetch_add per chunk
+ *  - guided: like dynamic, but each chunk is remaining / (2P), never below chunk_size;
+ *    big chunks early, small ones at the end to fill the gaps
+ *
+ * Nested loops: a parallel_for called from inside the body of another one runs serially on
+ * that thread. The outer loop already has every worker busy, so queueing more
+ * participants would only add overhead.
+ *
+ * The first exception stops participants from claiming more work and is rethrown by the
+ * caller once every participant has returned.
+*/
+
+enum class loop_schedule
+{
+    static_chunks,
+    dynamic,
+    guided
+};
+
+struct for_schedule
+{
+    loop_schedule kind = loop_schedule::dynamic;
+    std::size_t chunk_size = 0; // 0: picked from the range and pool size; guided: the minimum
+};
+
+namespace detail
+{
+    inline thread_local unsigned parallel_for_depth = 0;
+
+    template <typename Index, typename Body>
+    struct parallel_for_state
+    {
+        Index begin;
+        std::size_t count;
+        Body const &body;
+        loop_schedule kind;
+        std::size_t chunk;
+        unsigned participants;
+        std::atomic<std::size_t> next{0};
+        std::atomic<unsigned> next_participant{0};
+        std::atomic<bool> failed{false};
+        std::mutex error_mutex;
+        std::exception_ptr error;
+
+        parallel_for_state(Index begin_, std::size_t count_, Body const &body_,
+                           for_schedule schedule, unsigned participants_)
+            : begin(begin_), count(count_), body(body_), kind(schedule.kind),
+              participants(participants_)
+        {
+            std::size_t const per_participant = (count + participants - 1) / participants;
+            if (schedule.chunk_size != 0)
+                chunk = schedule.chunk_size;
+            else if (kind == loop_schedule::static_chunks)
+                chunk = per_participant;
+            else if (kind == loop_schedule::dynamic)
+                chunk = std::max<std::size_t>(per_participant / 16, 1);
+            else
+                chunk = 1;
+        }
+
+        void run(std::size_t from, std::size_t to)
+        {
+            for (std::size_t i = from; i < to; ++i)
+                body(static_cast<Index>(begin + static_cast<Index>(i)));
+        }
+
+        // Next [from, to) for dynamic and guided; false once everything is handed out
+        bool claim(std::size_t &from, std::size_t &to)
+        {
+            if (kind == loop_schedule::dynamic)
+            {
+                from = next.fetch_add(chunk, std::memory_order_relaxed);
+                to = std::min(from + chunk, count);
+                return from < count;
+            }
+            std::size_t current = next.load(std::memory_order_relaxed);
+            while (current < count)
+            {
+                std::size_t const size = std::max(chunk, (count - current) / (2 * participants));
+                if (next.compare_exchange_weak(current, current + size, std::memory_order_relaxed))
+                {
+                    from = current;
+                    to = std::min(current + size, count);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void participate()
+        {
+            ++parallel_for_depth;
+            try
+            {
+                if (kind == loop_schedule::static_chunks)
+                {
+                    unsigned const k = next_participant.fetch_add(1, std::memory_order_relaxed);
+                    for (std::size_t from = k * chunk; from < count && !failed.load(std::memory_order_relaxed);
+                         from += std::size_t(participants) * chunk)
+                        run(from, std::min(from + chunk, count));
+                }
+                else
+                {
+                    std::size_t from = 0, to = 0;
+                    while (!failed.load(std::memory_order_relaxed) && claim(from, to))
+                        run(from, to);
+                }
+            }
+            catch (...)
+            {
+                record_failure();
+            }
+            --parallel_for_depth;
+        }
+
+        void record_failure()
+        {
+            std::lock_guard<std::mutex> lk(error_mutex);
+            if (!error)
+                error = std::current_exception();
+            failed = true;
+        }
+    };
+}
+
+template <typename Index, typename Body>
+void parallel_for(thread_pool &pool, Index begin, Index end, Body const &body,
+                  for_schedule schedule = for_schedule())
+{
+    static_assert(std::is_integral_v<Index>, "parallel_for iterates over an integer range");
+    if (!(begin < end))
+        return;
+
+    std::size_t const count = static_cast<std::size_t>(end - begin);
+    unsigned const participants = detail::parallel_for_depth > 0
+        ? 1u
+        : static_cast<unsigned>(std::min<std::size_t>(std::max(pool.size(), 1u), count));
+
+    detail::parallel_for_state<Index, Body> state(begin, count, body, schedule, participants);
+    if (schedule.kind == loop_schedule::static_chunks && participants == 1)
+        state.chunk = count;
+
+    std::vector<std::future<void>> helpers;
+    try
+    {
+        for (unsigned i = 1; i < participants; ++i)
+            helpers.push_back(pool.submit([&state] { state.participate(); }));
+    }
+    catch (...)
+    {
+        state.record_failure(); // the helpers already queued just find nothing to do
+    }
+    state.participate();
+
+    for (auto &entry : helpers)
+        pool.wait(entry);
+    if (state.error)
+        std::rethrow_exception(state.error);
+}
+
+// body(element) for every element of a random-access range
+template <typename Iterator, typename Body>
+void parallel_for_each(thread_pool &pool, Iterator first, Iterator last, Body const &body,
+                       for_schedule schedule = for_schedule())
+{
+    parallel_for(pool, std::size_t(0), static_cast<std::size_t>(last - first),
+                 [first, &body](std::size_t i) { body(first[i]); }, schedule);
+}
+
+// f() from 2.3: do_work(i) costs differ, so hand them out one at a time
+void f_parallel_for(thread_pool &pool)
+{
+    parallel_for(pool, 0, 20, [](int i) { do_work(static_cast<uint8_t>(i)); },
+                 for_schedule{loop_schedule::dynamic, 1});
+}
+
+/* **************************************************************************************** */
+
+/** Sorting and partitioning on the pool
+ *
+ * Both split the range the way pooled_accumulate does: at most pool.size() blocks, none
+ * smaller than grain_size elements, and one block means plain std::sort / std::partition on
+ * the calling thread. The phases run through parallel_for. Their cost per element isn't
+ * calibrated, so grain_size defaults to uncalibrated_grain_size from 9.1.3, the same size
+ * below which an uncalibrated parallel_accumulate stays on the calling thread.
+ *
+ * parallel_sort, a parallel sort by regular sampling:
+ *
+ *  - every block is sorted with std::sort
+ *  - p evenly spaced samples per block give p - 1 splitters; each block is cut at the
+ *    splitters with lower_bound, so piece k of every block holds the same key range
+ *  - the p pieces with index k are merged (a heap over the piece heads) into their final
+ *    place in a buffer, then the buffer is moved back. Equal keys always go to the same
+ *    piece, so many duplicates unbalance the merge, but never break it
+ *  - needs a default-constructible, movable value_type for the buffer; not stable. If comp
+ *    throws, the range is left in an unspecified order, as with std::sort
+ *
+ * parallel_partition, in place:
+ *
+ *  - every block is partitioned with std::partition, which gives the total number of
+ *    elements that satisfy pred and so the final partition point
+ *  - the falses left of that point and the trues right of it are equally many; the j-th of
+ *    one kind is swapped with the j-th of the other, in parallel chunks of j
+ *  - not stable, like std::partition
+*/
+
+namespace detail
+{
+    inline std::size_t sort_block_count(thread_pool &pool, std::size_t length, std::size_t grain_size)
+    {
+        if (parallel_for_depth > 0) // already inside a parallel_for: stay on this thread
+            return 1;
+        return std::max<std::size_t>(
+            std::min<std::size_t>(std::max(pool.size(), 1u), length / grain_size), 1);
+    }
+
+    // Offsets of elements in a list of [begin, end) offset ranges, as if they were one sequence
+    struct offset_ranges
+    {
+        std::vector<std::size_t> begins, ends, ranks; // ranks[i]: elements before range i
+
+        void add(std::size_t begin, std::size_t end)
+        {
+            if (begin >= end)
+                return;
+            ranks.push_back(ranks.empty() ? 0 : ranks.back() + (ends.back() - begins.back()));
+            begins.push_back(begin);
+            ends.push_back(end);
+        }
+
+        std::size_t size() const noexcept
+        {
+            return ranks.empty() ? 0 : ranks.back() + (ends.back() - begins.back());
+        }
+
+        // Calls f(offset) for the elements with rank [from, to)
+        template <typename F>
+        void for_each(std::size_t from, std::size_t to, F &&f) const
+        {
+            std::size_t range = static_cast<std::size_t>(
+                std::upper_bound(ranks.begin(), ranks.end(), from) - ranks.begin()) - 1;
+            std::size_t offset = begins[range] + (from - ranks[range]);
+            for (std::size_t rank = from; rank < to; ++rank)
+            {
+                if (offset == ends[range])
+                    offset = begins[++range];
+                f(offset++);
+            }
+        }
+    };
+}
+
+template <typename Iterator, typename Compare = std::less<>>
+void parallel_sort(thread_pool &pool, Iterator first, Iterator last, Compare comp = Compare(),
+                   std::size_t grain_size = uncalibrated_grain_size)
+{
+    static_assert(std::random_access_iterator<Iterator>, "blocks are addressed by offset");
+    using value_type = typename std::iterator_traits<Iterator>::value_type;
+
+    grain_size = std::max<std::size_t>(grain_size, 1);
+    std::size_t const length = static_cast<std::size_t>(last - first);
+    std::size_t const blocks = detail::sort_block_count(pool, length, grain_size);
+    if (blocks == 1)
+    {
+        std::sort(first, last, comp);
+        return;
+    }
+
+    auto const block_begin = [first, length, blocks](std::size_t i) {
+        return first + static_cast<std::ptrdiff_t>(length / blocks * i);
+    };
+    auto const block_end = [&](std::size_t i) { return i + 1 == blocks ? last : block_begin(i + 1); };
+
+    parallel_for(pool, std::size_t(0), blocks,
+                 [&](std::size_t i) { std::sort(block_begin(i), block_end(i), comp); },
+                 for_schedule{loop_schedule::dynamic, 1});
+
+    std::vector<Iterator> samples;
+    samples.reserve(blocks * blocks);
+    for (std::size_t i = 0; i < blocks; ++i)
+        for (std::size_t j = 0; j < blocks; ++j)
+            samples.push_back(block_begin(i) + static_cast<std::ptrdiff_t>(length / blocks * j / blocks));
+    std::sort(samples.begin(), samples.end(),
+              [&comp](Iterator a, Iterator b) { return comp(*a, *b); });
+
+    // piece k of block i: [cuts[i][k], cuts[i][k + 1]); splitter k is samples[k * blocks]. All
+    // cut before any merge starts: merging moves elements out, splitters included
+    std::vector<std::vector<Iterator>> cuts(blocks);
+    parallel_for(pool, std::size_t(0), blocks, [&](std::size_t i) {
+        cuts[i].push_back(block_begin(i));
+        for (std::size_t k = 1; k < blocks; ++k)
+            cuts[i].push_back(std::lower_bound(cuts[i].back(), block_end(i), *samples[k * blocks], comp));
+        cuts[i].push_back(block_end(i));
+    });
+
+    std::vector<value_type> buffer(length);
+    parallel_for(pool, std::size_t(0), blocks, [&](std::size_t k) {
+        std::vector<std::pair<Iterator, Iterator>> heads;
+        std::size_t offset = 0;
+        for (std::size_t i = 0; i < blocks; ++i)
+        {
+            offset += static_cast<std::size_t>(cuts[i][k] - block_begin(i));
+            if (cuts[i][k] != cuts[i][k + 1])
+                heads.emplace_back(cuts[i][k], cuts[i][k + 1]);
+        }
+
+        auto const later = [&comp](auto const &a, auto const &b) { return comp(*b.first, *a.first); };
+        std::make_heap(heads.begin(), heads.end(), later);
+        auto out = buffer.begin() + static_cast<std::ptrdiff_t>(offset);
+        while (!heads.empty())
+        {
+            std::pop_heap(heads.begin(), heads.end(), later);
+            auto &smallest = heads.back();
+            *out++ = std::move(*smallest.first++);
+            if (smallest.first == smallest.second)
+                heads.pop_back();
+            else
+                std::push_heap(heads.begin(), heads.end(), later);
+        }
+    }, for_schedule{loop_schedule::dynamic, 1});
+
+    parallel_for(pool, std::size_t(0), blocks, [&](std::size_t i) {
+        std::move(buffer.begin() + (block_begin(i) - first), buffer.begin() + (block_end(i) - first),
+                  block_begin(i));
+    });
+}
+
+// Returns the partition point, like std::partition
+template <typename Iterator, typename Predicate>
+Iterator parallel_partition(thread_pool &pool, Iterator first, Iterator last, Predicate pred,
+                            std::size_t grain_size = uncalibrated_grain_size)
+{
+    static_assert(std::random_access_iterator<Iterator>, "blocks are addressed by offset");
+
+    grain_size = std::max<std::size_t>(grain_size, 1);
+    std::size_t const length = static_cast<std::size_t>(last - first);
+    std::size_t const blocks = detail::sort_block_count(pool, length, grain_size);
+    if (blocks == 1)
+        return std::partition(first, last, pred);
+
+    auto const block_begin = [length, blocks](std::size_t i) { return length / blocks * i; };
+    auto const block_end = [&](std::size_t i) { return i + 1 == blocks ? length : block_begin(i + 1); };
+
+    std::vector<std::size_t> middles(blocks); // block i is [begin, middle) trues, [middle, end) falses
+    parallel_for(pool, std::size_t(0), blocks, [&](std::size_t i) {
+        middles[i] = static_cast<std::size_t>(
+            std::partition(first + block_begin(i), first + block_end(i), pred) - first);
+    }, for_schedule{loop_schedule::dynamic, 1});
+
+    std::size_t point = 0;
+    for (std::size_t i = 0; i < blocks; ++i)
+        point += middles[i] - block_begin(i);
+
+    detail::offset_ranges misplaced_falses, misplaced_trues;
+    for (std::size_t i = 0; i < blocks; ++i)
+    {
+        misplaced_falses.add(middles[i], std::min(block_end(i), point));
+        misplaced_trues.add(std::max(block_begin(i), point), middles[i]);
+    }
+
+    std::size_t const swaps = misplaced_falses.size();
+    std::size_t const chunk = std::max(swaps / blocks, grain_size);
+    parallel_for(pool, std::size_t(0), (swaps + chunk - 1) / chunk, [&](std::size_t c) {
+        std::size_t const from = c * chunk;
+        std::size_t const to = std::min(from + chunk, swaps);
+        std::vector<std::size_t> falses;
+        falses.reserve(to - from);
+        misplaced_falses.for_each(from, to, [&falses](std::size_t offset) { falses.push_back(offset); });
+        auto next_false = falses.begin();
+        misplaced_trues.for_each(from, to, [&](std::size_t offset) {
+            std::iter_swap(first + static_cast<std::ptrdiff_t>(*next_false++),
+                           first + static_cast<std::ptrdiff_t>(offset));
+        });
+    });
+    return first + static_cast<std::ptrdiff_t>(point);
+}
+
+// e.g. the nightly batch: records ordered by key, then the stale ones split off
+struct batch_record
+{
+    std::uint64_t key;
+    std::uint32_t age_days;
+    std::uint32_t payload;
+};
+
+std::size_t sort_and_split_batch(thread_pool &pool, std::vector<batch_record> &records)
+{
+    parallel_sort(pool, records.begin(), records.end(),
+                  [](batch_record const &a, batch_record const &b) { return a.key < b.key; });
+    auto const fresh_end = parallel_partition(pool, records.begin(), records.end(),
+                                              [](batch_record const &r) { return r.age_days < 30; });
+    return static_cast<std::size_t>(fresh_end - records.begin());
+}
+
+// Spawn-per-task vs pool for 20, 1000 and 100000 tasks: BM_spawn_per_task and BM_pool_submit
+// in "11 - Testing and Debugging Multithreaded Applications.cpp"
+
+/* **************************************************************************************** */
+
+// 9.1.2 - 9.1.3 parallel_accumulate on the pool, with padded<T> and the grain size
+// calibration: include/pooled_accumulate.h
+
+/* **************************************************************************************** */
+
+/** 9.1.7 NUMA-aware parallel_accumulate
+ *
+ * Linux places a page on the node of the thread that first writes it (first touch).
+ * A buffer filled by the main thread lives entirely on the main thread's node, and every
+ * worker on the other socket reads it remotely.
+ *
+ *  - numa_first_touch_fill() splits the buffer into node_count() contiguous regions and has
+ *    the workers of node k write region k, so the pages end up spread the same way
+ *  - parallel_accumulate(pool, first, last, init, numa_local) looks up the node of each
+ *    block's first page and submits the block to that node's workers (any worker if the
+ *    page is on a node without CPUs)
+ *
+ * Only useful with a pool built with pin_to_numa_nodes, and only for memory that hasn't
+ * been touched yet: std::vector<T>(n) value-initializes (touches) everything on the calling
+ * thread, so allocate with new T[n] or a non-initializing allocator first.
+*/
+
+struct numa_local_t
+{
+};
+constexpr numa_local_t numa_local{};
+
+template <typename Iterator, typename T>
+void numa_first_touch_fill(thread_pool &pool, Iterator first, Iterator last, T const &value)
+{
+    static_assert(std::contiguous_iterator<Iterator>, "first touch needs contiguous memory");
+    unsigned long const length = last - first;
+    unsigned const nodes = pool.node_count();
+    unsigned const per_node = std::max(pool.size() / nodes, 1u);
+    unsigned long const block_size = std::max(length / (nodes * per_node), 1ul);
+
+    std::vector<std::future<void>> futures;
+    for (unsigned long start = 0; start < length; start += block_size)
+    {
+        unsigned long const end = std::min(start + block_size, length);
+        unsigned const node = static_cast<unsigned>((start * nodes) / length);
+        futures.push_back(pool.submit_to_node(node, [first, start, end, &value] {
+            std::fill(first + start, first + end, value);
+        }));
+    }
+    for (auto &entry : futures)
+    {
+        pool.wait(entry);
+        entry.get();
+    }
+}
+
+template <typename Iterator, typename T>
+T parallel_accumulate(thread_pool &pool, Iterator first, Iterator last, T init, numa_local_t)
+{
+    static_assert(std::contiguous_iterator<Iterator>, "page lookup needs contiguous memory");
+    unsigned long const length = last - first;
+
+    if (!length)
+        return init;
+
+    unsigned long const min_per_thread = 25;
+    unsigned long const max_blocks = (length + min_per_thread - 1) / min_per_thread;
+    unsigned long const num_blocks =
+        std::min<unsigned long>(pool.size() != 0 ? pool.size() : 1, max_blocks);
+    unsigned long const block_size = length / num_blocks;
+
+    std::vector<padded<T>> results(num_blocks);
+    std::vector<std::future<void>> futures;
+    futures.reserve(num_blocks);
+
+    for (unsigned long i = 0; i < num_blocks; ++i)
+    {
+        Iterator const block_start = first + i * block_size;
+        Iterator const block_end = i == num_blocks - 1 ? last : block_start + block_size;
+        int const os_node = numa_node_of(std::to_address(block_start));
+        int const node = os_node >= 0 ? pool.node_index(static_cast<unsigned>(os_node)) : -1;
+        auto block = [block_start, block_end, &result = results[i].value] {
+            accumulate_block<Iterator, T>()(block_start, block_end, result);
+        };
+        futures.push_back(node >= 0 ? pool.submit_to_node(static_cast<unsigned>(node), block)
+                                    : pool.submit(block));
+    }
+
+    std::exception_ptr error;
+    for (auto &entry : futures) // all of them, they write into results
+    {
+        pool.wait(entry);
+        try
+        {
+            entry.get();
+        }
+        catch (...)
+        {
+            if (!error)
+                error = std::current_exception();
+        }
+    }
+    if (error)
+        std::rethrow_exception(error);
+
+    T result = init;
+    for (auto const &partial : results)
+        result = result + partial.value;
+    return result;
+}
+
+/* **************************************************************************************** */
+
+/** 9.1.4 Asynchronous parallel_accumulate
+ *
+ * Every parallel_accumulate above blocks the caller until the last block is joined. A
+ * request handler that needs three independent totals pays for them one after another.
+ *
+ * async_parallel_accumulate() submits the blocks and returns a pool_future<T> right away:
+ *
+ *  - the block that finishes last combines the partials and fulfils the future, so no
+ *    thread sits in a join or in the final serial sum
+ *  - then(f) queues f(value) on the pool once the value is there and returns another
+ *    pool_future; an exception skips f and travels down the chain
+ *  - get()/wait() on a worker thread run other pool tasks while waiting (like
+ *    thread_pool::wait), so a task can wait on a reduction without deadlocking the pool
+ *
+ * The range has to outlive the future. The grain size comes from the calibrated cost in
+ * 9.1.3 when there is one; this never calibrates on the caller.
+*/
+
+template <typename T>
+class pool_future;
+
+namespace detail
+{
+    template <typename T>
+    struct pool_future_state
+    {
+        std::promise<T> promise;
+        std::shared_future<T> result{promise.get_future().share()};
+        std::mutex m;
+        bool finished = false;
+        std::vector<function_wrapper> continuations;
+
+        // Calls produce() and stores its value or exception, then releases the continuations
+        template <typename Producer>
+        void complete(Producer &&produce)
+        {
+            try
+            {
+                if constexpr (std::is_void_v<T>)
+                {
+                    produce();
+                    promise.set_value();
+                }
+                else
+                {
+                    promise.set_value(produce());
+                }
+            }
+            catch (...)
+            {
+                promise.set_exception(std::current_exception());
+            }
+
+            std::vector<function_wrapper> ready;
+            {
+                std::lock_guard<std::mutex> lk(m);
+                finished = true;
+                ready.swap(continuations);
+            }
+            for (auto &continuation : ready)
+                continuation();
+        }
+    };
+
+    template <typename T, typename F>
+    struct continuation_result
+    {
+        using type = std::invoke_result_t<F, T>;
+    };
+
+    template <typename F>
+    struct continuation_result<void, F>
+    {
+        using type = std::invoke_result_t<F>;
+    };
+}
+
+template <typename T>
+class pool_future
+{
+    thread_pool *pool = nullptr;
+    std::shared_ptr<detail::pool_future_state<T>> state;
+
+public:
+    pool_future() = default;
+
+    pool_future(thread_pool &pool_, std::shared_ptr<detail::pool_future_state<T>> state_)
+        : pool(&pool_), state(std::move(state_))
+    {}
+
+    bool valid() const noexcept
+    {
+        return state != nullptr;
+    }
+
+    bool is_ready() const
+    {
+        return state->result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    void wait() const
+    {
+        if (!pool->is_worker_thread())
+        {
+            state->result.wait();
+            return;
+        }
+        while (!is_ready())
+            pool->run_pending_task();
+    }
+
+    // A copy of the value (or void); rethrows the stored exception. Can be called repeatedly.
+    T get() const
+    {
+        wait();
+        return state->result.get();
+    }
+
+    template <typename F>
+    pool_future<typename detail::continuation_result<T, std::decay_t<F>>::type> then(F &&f)
+    {
+        using result_type = typename detail::continuation_result<T, std::decay_t<F>>::type;
+        auto next = std::make_shared<detail::pool_future_state<result_type>>();
+
+        auto run = [source = state->result, next, f = std::forward<F>(f)]() mutable {
+            next->complete([&]() -> result_type {
+                if constexpr (std::is_void_v<T>)
+                {
+                    source.get();
+                    return f();
+                }
+                else
+                {
+                    return f(source.get());
+                }
+            });
+        };
+        auto schedule = [target = pool, run = std::move(run)]() mutable {
+            target->submit(std::move(run));
+        };
+
+        {
+            std::lock_guard<std::mutex> lk(state->m);
+            if (!state->finished)
+            {
+                state->continuations.emplace_back(std::move(schedule));
+                return pool_future<result_type>(*pool, std::move(next));
+            }
+        }
+        schedule();
+        return pool_future<result_type>(*pool, std::move(next));
+    }
+};
+
+namespace detail
+{
+    template <typename T>
+    struct async_accumulate_blocks
+    {
+        std::vector<padded<T>> results;
+        std::vector<std::exception_ptr> errors;
+        std::atomic<unsigned long> remaining;
+        T init;
+        std::shared_ptr<pool_future_state<T>> state;
+
+        async_accumulate_blocks(unsigned long num_blocks, T init_)
+            : results(num_blocks), errors(num_blocks), remaining(num_blocks),
+              init(std::move(init_)), state(std::make_shared<pool_future_state<T>>())
+        {}
+
+        // Called once per block, and for blocks that never got submitted
+        void block_done(unsigned long count = 1)
+        {
+            if (remaining.fetch_sub(count, std::memory_order_acq_rel) != count)
+                return;
+            state->complete([this] {
+                for (auto const &error : errors)
+                    if (error)
+                        std::rethrow_exception(error);
+                T result = init;
+                for (auto const &partial : results)
+                    result = result + partial.value;
+                return result;
+            });
+        }
+    };
+}
+
+template <typename Iterator, typename T>
+pool_future<T> async_parallel_accumulate(thread_pool &pool, Iterator first, Iterator last, T init)
+{
+    unsigned long const length = std::distance(first, last);
+    double const ns_per_element =
+        accumulate_cost<Iterator, T>::ns_per_element.load(std::memory_order_relaxed);
+    unsigned long const grain_size = ns_per_element != 0.0
+        ? std::max(static_cast<unsigned long>(target_block_ns / ns_per_element), 1ul)
+        : calibration_elements;
+
+    unsigned long const max_blocks = (length + grain_size - 1) / grain_size;
+    unsigned long const num_blocks =
+        std::min<unsigned long>(pool.size() != 0 ? pool.size() : 1, max_blocks);
+
+    if (!num_blocks)
+    {
+        auto state = std::make_shared<detail::pool_future_state<T>>();
+        state->complete([&init] { return init; });
+        return pool_future<T>(pool, std::move(state));
+    }
+
+    unsigned long const block_size = length / num_blocks;
+    auto blocks = std::make_shared<detail::async_accumulate_blocks<T>>(num_blocks, std::move(init));
+    pool_future<T> result(pool, blocks->state);
+
+    Iterator block_start = first;
+    for (unsigned long i = 0; i < num_blocks; ++i)
+    {
+        Iterator block_end = block_start;
+        if (i == num_blocks - 1)
+            block_end = last;
+        else
+            std::advance(block_end, block_size);
+        try
+        {
+            pool.submit([blocks, i, block_start, block_end] {
+                try
+                {
+                    accumulate_block<Iterator, T>()(block_start, block_end, blocks->results[i].value);
+                }
+                catch (...)
+                {
+                    blocks->errors[i] = std::current_exception();
+                }
+                blocks->block_done();
+            });
+        }
+        catch (...)
+        {
+            blocks->errors[i] = std::current_exception(); // reported through the future
+            blocks->block_done(num_blocks - i);
+            break;
+        }
+        block_start = block_end;
+    }
+    return result;
+}
+
+// e.g. two independent totals in flight at once, plus a derived value
+inline pool_future<double> async_mean_of_sums(thread_pool &pool,
+                                              std::vector<double> const &a,
+                                              std::vector<double> const &b)
+{
+    pool_future<double> sum_a = async_parallel_accumulate(pool, a.begin(), a.end(), 0.0);
+    pool_future<double> sum_b = async_parallel_accumulate(pool, b.begin(), b.end(), 0.0);
+    return sum_a.then([sum_b](double total_a) {
+        return (total_a + sum_b.get()) / 2.0; // runs on a worker: get() helps instead of blocking
+    });
+}
+
+/* **************************************************************************************** */
+
+/** Coroutines on the pool
+ *
+ * edit_document from 2.1.3 holds a whole thread (and its stack) while get_user_input()
+ * waits. A coroutine that waits is just a suspended heap frame, so thousands of sessions
+ * can share a handful of pool workers.
+ *
+ *  - task<T>: lazy, move-only; starts when co_awaited and resumes the awaiting coroutine
+ *    when it finishes (symmetric transfer, so long chains don't grow the stack)
+ *  - co_await schedule(pool): continue on a pool worker
+ *  - co_await timer.sleep_for(pool, d): a coroutine_timer thread keeps the deadlines and
+ *    resumes the coroutine on the pool when its time is up; no worker is held meanwhile
+ *  - co_await when_all(std::move(tasks)): runs task<void>s concurrently, rethrows the first
+ *    failure once all have finished
+ *  - sync_wait(task): the bridge from ordinary code; blocks the calling thread, so don't
+ *    call it from a pool worker
+*/
+
+template <typename T = void>
+class task;
+
+namespace detail
+{
+    struct task_promise_base
+    {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+
+        struct final_awaiter
+        {
+            bool await_ready() const noexcept { return false; }
+
+            template <typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
+            {
+                std::coroutine_handle<> const next = h.promise().continuation;
+                return next ? next : std::noop_coroutine();
+            }
+
+            void await_resume() const noexcept {}
+        };
+
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        final_awaiter final_suspend() const noexcept { return {}; }
+        void unhandled_exception() noexcept { error = std::current_exception(); }
+    };
+
+    template <typename T>
+    struct task_promise : task_promise_base
+    {
+        std::optional<T> value;
+
+        task<T> get_return_object() noexcept;
+
+        template <typename U>
+        void return_value(U &&v)
+        {
+            value.emplace(std::forward<U>(v));
+        }
+
+        T result()
+        {
+            if (error)
+                std::rethrow_exception(error);
+            return std::move(*value);
+        }
+    };
+
+    template <>
+    struct task_promise<void> : task_promise_base
+    {
+        task<void> get_return_object() noexcept;
+        void return_void() const noexcept {}
+
+        void result()
+        {
+            if (error)
+                std::rethrow_exception(error);
+        }
+    };
+}
+
+template <typename T>
+class task
+{
+public:
+    using promise_type = detail::task_promise<T>;
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    template <bool TakeResult>
+    struct awaiter
+    {
+        std::coroutine_handle<promise_type> handle;
+
+        bool await_ready() const noexcept
+        {
+            return handle.done();
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            handle.promise().continuation = awaiting;
+            return handle; // start the task; it resumes awaiting when done
+        }
+
+        decltype(auto) await_resume()
+        {
+            if constexpr (TakeResult)
+                return handle.promise().result();
+        }
+    };
+
+public:
+    explicit task(std::coroutine_handle<promise_type> h) noexcept : handle(h) {}
+
+    task(task &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+
+    task &operator=(task &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (handle)
+                handle.destroy();
+            handle = std::exchange(other.handle, {});
+        }
+        return *this;
+    }
+
+    ~task()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    task(task const &) = delete;
+    task &operator=(task const &) = delete;
+
+    auto operator co_await() const noexcept
+    {
+        return awaiter<true>{handle};
+    }
+
+    // Wait for the task to finish without taking its result (or its exception)
+    auto when_ready() const noexcept
+    {
+        return awaiter<false>{handle};
+    }
+
+    // Only once the task has finished: the co_returned value, or rethrows
+    T result()
+    {
+        return handle.promise().result();
+    }
+};
+
+template <typename T>
+task<T> detail::task_promise<T>::get_return_object() noexcept
+{
+    return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> detail::task_promise<void>::get_return_object() noexcept
+{
+    return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+// co_await schedule(pool): the rest of the coroutine runs as a pool task
+inline auto schedule(thread_pool &pool)
+{
+    struct schedule_awaiter
+    {
+        thread_pool &pool;
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            pool.submit([h] { h.resume(); });
+        }
+
+        void await_resume() const noexcept {}
+    };
+    return schedule_awaiter{pool};
+}
+
+class coroutine_timer
+{
+    using clock = std::chrono::steady_clock;
+
+    struct sleeper
+    {
+        clock::time_point deadline;
+        std::coroutine_handle<> handle;
+        thread_pool *pool;
+
+        bool operator>(sleeper const &other) const noexcept
+        {
+            return deadline > other.deadline;
+        }
+    };
+
+    std::mutex m;
+    std::condition_variable wake;
+    std::priority_queue<sleeper, std::vector<sleeper>, std::greater<>> sleepers;
+    bool done = false;
+    std::thread worker;
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lk(m);
+        for (;;)
+        {
+            if (sleepers.empty())
+            {
+                if (done)
+                    return;
+                wake.wait(lk);
+                continue;
+            }
+            // on shutdown every sleeper is resumed early rather than leaked
+            clock::time_point const next_deadline = sleepers.top().deadline; // a copy: pushes reallocate
+            if (!done && clock::now() < next_deadline)
+            {
+                wake.wait_until(lk, next_deadline);
+                continue;
+            }
+            sleeper const due = sleepers.top();
+            sleepers.pop();
+            lk.unlock();
+            due.pool->submit([h = due.handle] { h.resume(); });
+            lk.lock();
+        }
+    }
+
+    struct sleep_awaiter
+    {
+        coroutine_timer &timer;
+        thread_pool &pool;
+        clock::time_point deadline;
+
+        bool await_ready() const noexcept
+        {
+            return clock::now() >= deadline;
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            {
+                std::lock_guard<std::mutex> lk(timer.m);
+                timer.sleepers.push(sleeper{deadline, h, &pool});
+            }
+            timer.wake.notify_one();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+public:
+    coroutine_timer() : worker(&coroutine_timer::run, this) {}
+
+    ~coroutine_timer()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            done = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    coroutine_timer(coroutine_timer const &) = delete;
+    coroutine_timer &operator=(coroutine_timer const &) = delete;
+
+    sleep_awaiter sleep_until(thread_pool &pool, clock::time_point deadline)
+    {
+        return sleep_awaiter{*this, pool, deadline};
+    }
+
+    template <typename Rep, typename Period>
+    sleep_awaiter sleep_for(thread_pool &pool, std::chrono::duration<Rep, Period> delay)
+    {
+        return sleep_until(pool, clock::now() + std::chrono::duration_cast<clock::duration>(delay));
+    }
+};
+
+namespace detail
+{
+    struct when_all_counter
+    {
+        std::atomic<std::size_t> remaining{0};
+        std::coroutine_handle<> parent;
+    };
+
+    // Awaits one task of a when_all; the last one to finish resumes the parent
+    struct when_all_child
+    {
+        struct promise_type
+        {
+            when_all_counter &counter;
+
+            promise_type(task<void> &, when_all_counter &counter_) : counter(counter_) {}
+
+            when_all_child get_return_object() noexcept
+            {
+                return when_all_child{std::coroutine_handle<promise_type>::from_promise(*this)};
+            }
+
+            std::suspend_always initial_suspend() const noexcept { return {}; }
+
+            auto final_suspend() const noexcept
+            {
+                struct last_one_resumes
+                {
+                    bool await_ready() const noexcept { return false; }
+
+                    std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+                    {
+                        when_all_counter &counter = h.promise().counter;
+                        if (counter.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                            return counter.parent;
+                        return std::noop_coroutine();
+                    }
+
+                    void await_resume() const noexcept {}
+                };
+                return last_one_resumes{};
+            }
+
+            void return_void() const noexcept {}
+            void unhandled_exception() const noexcept { std::terminate(); } // when_ready() doesn't throw
+        };
+
+        std::coroutine_handle<promise_type> handle;
+
+        when_all_child(when_all_child &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+        explicit when_all_child(std::coroutine_handle<promise_type> h) noexcept : handle(h) {}
+
+        ~when_all_child()
+        {
+            if (handle)
+                handle.destroy();
+        }
+    };
+
+    inline when_all_child await_when_all_child(task<void> &t, when_all_counter &)
+    {
+        co_await t.when_ready();
+    }
+
+    struct when_all_awaiter
+    {
+        std::vector<when_all_child> &children;
+        when_all_counter &counter;
+
+        bool await_ready() const noexcept
+        {
+            return children.empty();
+        }
+
+        bool await_suspend(std::coroutine_handle<> parent) noexcept
+        {
+            counter.parent = parent;
+            // one extra count for this call, so the parent can't be resumed before it's suspended
+            counter.remaining.store(children.size() + 1, std::memory_order_relaxed);
+            for (auto &child : children)
+                child.handle.resume();
+            return counter.remaining.fetch_sub(1, std::memory_order_acq_rel) != 1;
+        }
+
+        void await_resume() const noexcept {}
+    };
+}
+
+inline task<void> when_all(std::vector<task<void>> tasks)
+{
+    detail::when_all_counter counter;
+    std::vector<detail::when_all_child> children;
+    children.reserve(tasks.size());
+    for (auto &t : tasks)
+        children.push_back(detail::await_when_all_child(t, counter));
+
+    co_await detail::when_all_awaiter{children, counter};
+
+    for (auto &t : tasks)
+        t.result(); // rethrows the first failure
+}
+
+namespace detail
+{
+    struct sync_wait_task
+    {
+        struct promise_type
+        {
+            std::mutex m;
+            std::condition_variable finished;
+            bool done = false;
+
+            sync_wait_task get_return_object() noexcept
+            {
+                return sync_wait_task{std::coroutine_handle<promise_type>::from_promise(*this)};
+            }
+
+            std::suspend_always initial_suspend() const noexcept { return {}; }
+
+            auto final_suspend() const noexcept
+            {
+                struct notify_waiter
+                {
+                    bool await_ready() const noexcept { return false; }
+
+                    void await_suspend(std::coroutine_handle<promise_type> h) noexcept
+                    {
+                        promise_type &promise = h.promise();
+                        std::lock_guard<std::mutex> lk(promise.m); // notify under the lock: the
+                        promise.done = true;                       // waiter destroys the frame
+                        promise.finished.notify_one();
+                    }
+
+                    void await_resume() const noexcept {}
+                };
+                return notify_waiter{};
+            }
+
+            void return_void() const noexcept {}
+            void unhandled_exception() const noexcept { std::terminate(); }
+        };
+
+        std::coroutine_handle<promise_type> handle;
+
+        explicit sync_wait_task(std::coroutine_handle<promise_type> h) noexcept : handle(h) {}
+
+        ~sync_wait_task()
+        {
+            handle.destroy();
+        }
+
+        sync_wait_task(sync_wait_task const &) = delete;
+        sync_wait_task &operator=(sync_wait_task const &) = delete;
+
+        void run_and_wait()
+        {
+            handle.resume();
+            promise_type &promise = handle.promise();
+            std::unique_lock<std::mutex> lk(promise.m);
+            promise.finished.wait(lk, [&promise] { return promise.done; });
+        }
+    };
+
+    template <typename T>
+    sync_wait_task await_for_sync_wait(task<T> &t)
+    {
+        co_await t.when_ready();
+    }
+}
+
+template <typename T>
+T sync_wait(task<T> t)
+{
+    detail::await_for_sync_wait(t).run_and_wait();
+    return t.result();
+}
+
+// edit_document as a coroutine. poll_user_input() stands in for a non-blocking check;
+// between checks the session is only a suspended frame, not a blocked thread.
+
+bool poll_user_input(std::string const &filename); // true when the user closed the document
+
+task<std::size_t> open_document_async(thread_pool &pool, std::string filename)
+{
+    co_await schedule(pool);
+    co_return filename.size(); // stands in for loading it
+}
+
+task<void> edit_document_session(thread_pool &pool, coroutine_timer &timer, std::string filename)
+{
+    std::size_t const loaded = co_await open_document_async(pool, filename);
+    (void)loaded;
+    while (!poll_user_input(filename))
+        co_await timer.sleep_for(pool, std::chrono::milliseconds(10));
+}
+
+void edit_documents(std::vector<std::string> const &filenames)
+{
+    thread_pool pool(4);
+    coroutine_timer timer;
+    std::vector<task<void>> sessions;
+    for (auto const &filename : filenames)
+        sessions.push_back(edit_document_session(pool, timer, filename));
+    sync_wait(when_all(std::move(sessions)));
+}
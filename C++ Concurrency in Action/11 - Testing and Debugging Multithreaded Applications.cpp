@@ -0,0 +1,282 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <numeric>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "include/deterministic_accumulate.h"
+#include "include/join_threads.h"
+#include "include/parallel_accumulate.h"
+#include "include/pooled_accumulate.h"
+#include "include/thread_wrappers.h"
+
+/*** 11.2.5 Testing performance: a benchmark suite for the patterns in these notes
+ *
+ * Google Benchmark (github.com/google/benchmark). Each pattern gets its own benchmark so
+ * the numbers can be compared side by side and tracked over time:
+ *
+ *  - thread creation + join: raw std::thread, thread_guard, scoped_thread, joining_thread
+ *  - detach vs join: detaching saves the join, not the creation
+ *  - spawn-per-task vs pool (9.1): f() from 2.3 with n trivial tasks, emplace_back/join
+ *    against submit() on a pool that already exists, for 20, 1000 and 100000 tasks
+ *  - parallel_accumulate (2.4), the pool version (9.1.2) on 1..N workers, and plain
+ *    std::accumulate, for 1k to 1G ints
+ *  - the cost of reproducible floating-point sums: parallel_accumulate on doubles vs
+ *    parallel_accumulate_deterministic (8) with each summation mode
+ *
+ * The code under test comes from the headers in include/. The CMakeLists.txt at the top of
+ * the repository builds this file as concurrency_bench, with Google Benchmark from
+ * find_package or, if it isn't installed, fetched from GitHub:
+ *
+ *     cmake -S . -B build && cmake --build build --target concurrency_bench
+ *
+ * For a file to track over time:
+ *
+ *     concurrency_bench --benchmark_format=json --benchmark_out=bench.json
+ *
+ * The 1G case needs 4 GB for the input; --benchmark_filter skips it on smaller machines.
+*/
+
+/* **************************************************************************************** */
+
+// Thread creation and join
+
+static void trivial_work() {}
+
+static void BM_std_thread_join(benchmark::State &state)
+{
+    for (auto _ : state)
+    {
+        std::thread t(trivial_work);
+        t.join();
+    }
+}
+BENCHMARK(BM_std_thread_join)->UseRealTime();
+
+static void BM_thread_guard(benchmark::State &state)
+{
+    for (auto _ : state)
+    {
+        std::thread t(trivial_work);
+        thread_guard guard(t);
+    }
+}
+BENCHMARK(BM_thread_guard)->UseRealTime();
+
+static void BM_scoped_thread(benchmark::State &state)
+{
+    for (auto _ : state)
+    {
+        scoped_thread t{std::thread(trivial_work)};
+    }
+}
+BENCHMARK(BM_scoped_thread)->UseRealTime();
+
+static void BM_joining_thread(benchmark::State &state)
+{
+    for (auto _ : state)
+    {
+        joining_thread t(trivial_work);
+    }
+}
+BENCHMARK(BM_joining_thread)->UseRealTime();
+
+// Detached threads signal completion themselves so the benchmark can wait for them at the end
+static void BM_detach(benchmark::State &state)
+{
+    std::atomic<std::int64_t> finished{0};
+    std::int64_t launched = 0;
+    for (auto _ : state)
+    {
+        std::thread t([&finished] {
+            finished.fetch_add(1, std::memory_order_release);
+            finished.notify_one();
+        });
+        t.detach();
+        ++launched;
+    }
+    // after the timed loop: only keeps the threads from outliving the benchmark
+    for (std::int64_t seen = finished.load(); seen != launched; seen = finished.load())
+        finished.wait(seen);
+}
+BENCHMARK(BM_detach)->UseRealTime();
+
+/* **************************************************************************************** */
+
+// Spawn-per-task vs pool
+
+static std::atomic<unsigned long> task_sink{0};
+
+static void tiny_work(unsigned id)
+{
+    task_sink.fetch_add(id, std::memory_order_relaxed);
+}
+
+// Keeps the emplace_back/join pattern as-is, so for 100k tasks it needs that many threads
+// alive at once and may hit the thread limit (EAGAIN). That is reported as the result
+// rather than hidden: it's the other cost of spawn-per-task
+static void BM_spawn_per_task(benchmark::State &state)
+{
+    auto const n = static_cast<unsigned>(state.range(0));
+    for (auto _ : state)
+    {
+        std::vector<std::thread> threads;
+        join_threads joiner(threads);
+        try
+        {
+            for (unsigned i = 0; i < n; ++i)
+                threads.emplace_back(tiny_work, i);
+        }
+        catch (std::system_error const &e)
+        {
+            state.SkipWithError(e.what());
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(n));
+}
+BENCHMARK(BM_spawn_per_task)->Arg(20)->Arg(1000)->Arg(100000)->UseRealTime();
+
+// The pool is constructed once, outside the timed loop: that's the point
+static void BM_pool_submit(benchmark::State &state)
+{
+    auto const n = static_cast<unsigned>(state.range(0));
+    thread_pool pool;
+    std::vector<std::future<void>> results;
+    results.reserve(n);
+    for (auto _ : state)
+    {
+        for (unsigned i = 0; i < n; ++i)
+            results.push_back(pool.submit(tiny_work, i));
+        for (auto &entry : results)
+            entry.get();
+        results.clear();
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(n));
+    state.counters["workers"] = static_cast<double>(pool.size());
+}
+BENCHMARK(BM_pool_submit)->Arg(20)->Arg(1000)->Arg(100000)->UseRealTime();
+
+/* **************************************************************************************** */
+
+// Accumulate scaling
+
+static std::vector<int> const &input_of_size(std::size_t n)
+{
+    static std::unique_ptr<std::vector<int>> input;
+    if (!input || input->size() != n)
+    {
+        input.reset(); // free the previous size first, the biggest one is 4 GB
+        input = std::make_unique<std::vector<int>>(n, 1);
+    }
+    return *input;
+}
+
+static void set_counters(benchmark::State &state, std::size_t n)
+{
+    state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(n));
+    state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(n * sizeof(int)));
+}
+
+static void BM_std_accumulate(benchmark::State &state)
+{
+    auto const &input = input_of_size(static_cast<std::size_t>(state.range(0)));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(std::accumulate(input.begin(), input.end(), 0L));
+    set_counters(state, input.size());
+}
+
+static void BM_parallel_accumulate(benchmark::State &state)
+{
+    auto const &input = input_of_size(static_cast<std::size_t>(state.range(0)));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(parallel_accumulate(input.begin(), input.end(), 0L));
+    set_counters(state, input.size());
+}
+
+static void BM_pooled_parallel_accumulate(benchmark::State &state)
+{
+    auto const &input = input_of_size(static_cast<std::size_t>(state.range(0)));
+    thread_pool pool(static_cast<unsigned>(state.range(1)));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(parallel_accumulate(pool, input.begin(), input.end(), 0L));
+    set_counters(state, input.size());
+    state.counters["threads"] = static_cast<double>(state.range(1));
+}
+
+static void accumulate_sizes(benchmark::internal::Benchmark *b)
+{
+    for (std::int64_t n = 1 << 10; n <= (std::int64_t(1) << 30); n *= 32)
+        b->Arg(n);
+}
+
+static void accumulate_sizes_and_threads(benchmark::internal::Benchmark *b)
+{
+    unsigned const hardware_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<unsigned> thread_counts;
+    for (unsigned threads = 1; threads < hardware_threads; threads *= 2)
+        thread_counts.push_back(threads);
+    thread_counts.push_back(hardware_threads);
+
+    for (std::int64_t n = 1 << 10; n <= (std::int64_t(1) << 30); n *= 32)
+        for (unsigned threads : thread_counts)
+            b->Args({n, static_cast<std::int64_t>(threads)});
+}
+
+BENCHMARK(BM_std_accumulate)->Apply(accumulate_sizes)->UseRealTime();
+BENCHMARK(BM_parallel_accumulate)->Apply(accumulate_sizes)->UseRealTime();
+BENCHMARK(BM_pooled_parallel_accumulate)->Apply(accumulate_sizes_and_threads)->UseRealTime();
+
+/* **************************************************************************************** */
+
+// Deterministic reduction overhead, on doubles
+
+static std::vector<double> const &doubles_of_size(std::size_t n)
+{
+    static std::unique_ptr<std::vector<double>> input;
+    if (!input || input->size() != n)
+    {
+        input.reset();
+        input = std::make_unique<std::vector<double>>(n);
+        for (std::size_t i = 0; i < n; ++i)
+            (*input)[i] = 1.0 / static_cast<double>(i + 1); // wide range of magnitudes
+    }
+    return *input;
+}
+
+static void BM_parallel_accumulate_double(benchmark::State &state)
+{
+    auto const &input = doubles_of_size(static_cast<std::size_t>(state.range(0)));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(parallel_accumulate(input.begin(), input.end(), 0.0));
+    state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(input.size()));
+}
+
+static void BM_deterministic_accumulate(benchmark::State &state)
+{
+    auto const &input = doubles_of_size(static_cast<std::size_t>(state.range(0)));
+    auto const mode = static_cast<summation>(state.range(1));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(
+            parallel_accumulate_deterministic(input.begin(), input.end(), 0.0, mode));
+    state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(input.size()));
+    state.SetLabel(mode == summation::naive ? "naive" : mode == summation::kahan ? "kahan" : "pairwise");
+}
+
+static void deterministic_sizes_and_modes(benchmark::internal::Benchmark *b)
+{
+    for (std::int64_t n = 1 << 10; n <= (std::int64_t(1) << 25); n *= 32)
+        for (summation mode : {summation::naive, summation::kahan, summation::pairwise})
+            b->Args({n, static_cast<std::int64_t>(mode)});
+}
+
+BENCHMARK(BM_parallel_accumulate_double)->RangeMultiplier(32)->Range(1 << 10, 1 << 25)->UseRealTime();
+BENCHMARK(BM_deterministic_accumulate)->Apply(deterministic_sizes_and_modes)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <exception>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+#include "join_threads.h"
+
+/*** Deterministic floating-point reduction
+ *
+ * parallel_accumulate takes num_threads from hardware_concurrency(), so the parenthesization
+ * of the sum, and with floating point the last bits of the result, depend on the machine.
+ * accumulate_block's vectorized path adds its own machine dependency (the vector width).
+ *
+ * parallel_accumulate_deterministic gives the same bits for the same input everywhere:
+ *
+ *  - the range is cut into logical chunks of chunk_size elements, whatever the thread count;
+ *    threads just take contiguous runs of chunks
+ *  - each chunk is summed serially in a fixed order: naive left to right, Kahan
+ *    (compensated) or pairwise (recursive halves, error grows with log n instead of n)
+ *  - chunk partials are combined in a fixed binary tree that depends only on the number of
+ *    chunks, and init is added last
+ *
+ * Don't build this with -ffast-math: it lets the compiler reassociate the sums (and drop
+ * the Kahan compensation entirely).
+*/
+
+enum class summation
+{
+    naive,
+    kahan,
+    pairwise
+};
+
+constexpr unsigned long deterministic_chunk_size = 4096;
+
+namespace detail
+{
+    template <typename Iterator, typename T>
+    T sum_pairwise(Iterator first, unsigned long length)
+    {
+        if (length <= 8)
+        {
+            T result = *first;
+            for (unsigned long i = 1; i < length; ++i)
+                result = result + *++first;
+            return result;
+        }
+        unsigned long const half = length / 2;
+        T const left = sum_pairwise<Iterator, T>(first, half);
+        return left + sum_pairwise<Iterator, T>(std::next(first, half), length - half);
+    }
+
+    template <typename Iterator, typename T>
+    T sum_chunk(Iterator first, unsigned long length, summation mode)
+    {
+        switch (mode)
+        {
+        case summation::pairwise:
+            return sum_pairwise<Iterator, T>(first, length);
+        case summation::kahan:
+        {
+            T sum = *first;
+            T compensation = T();
+            for (unsigned long i = 1; i < length; ++i)
+            {
+                T const y = T(*++first) - compensation;
+                T const t = sum + y;
+                compensation = (t - sum) - y;
+                sum = t;
+            }
+            return sum;
+        }
+        case summation::naive:
+        default:
+        {
+            T sum = *first;
+            for (unsigned long i = 1; i < length; ++i)
+                sum = sum + *++first;
+            return sum;
+        }
+        }
+    }
+
+    // Same shape for the same count: split at the midpoint, recursively
+    template <typename T>
+    T combine_tree(std::vector<T> const &partials, unsigned long lo, unsigned long hi)
+    {
+        if (hi - lo == 1)
+            return partials[lo];
+        unsigned long const mid = lo + (hi - lo) / 2;
+        return combine_tree(partials, lo, mid) + combine_tree(partials, mid, hi);
+    }
+}
+
+template <typename Iterator, typename T>
+T parallel_accumulate_deterministic(Iterator first, Iterator last, T init,
+                                    summation mode = summation::pairwise,
+                                    unsigned long chunk_size = deterministic_chunk_size)
+{
+    unsigned long const length = std::distance(first, last);
+
+    if (!length)
+        return init;
+
+    chunk_size = std::max(chunk_size, 1ul);
+    unsigned long const num_chunks = (length + chunk_size - 1) / chunk_size;
+    unsigned long const hardware_threads =
+        std::thread::hardware_concurrency();
+    unsigned long const num_threads =
+        std::min(hardware_threads != 0 ? hardware_threads : 2, num_chunks);
+    unsigned long const chunks_per_thread = num_chunks / num_threads;
+
+    std::vector<T> partials(num_chunks);
+    std::vector<std::exception_ptr> errors(num_threads);
+
+    // thread i: chunks [i * chunks_per_thread, ...), the last one takes the remainder
+    auto sum_chunks = [&](unsigned long i) {
+        try
+        {
+            unsigned long const chunk_first = i * chunks_per_thread;
+            unsigned long const chunk_last = i == num_threads - 1 ? num_chunks : chunk_first + chunks_per_thread;
+            Iterator chunk_start = std::next(first, chunk_first * chunk_size);
+            for (unsigned long c = chunk_first; c < chunk_last; ++c)
+            {
+                unsigned long const chunk_length = std::min(chunk_size, length - c * chunk_size);
+                partials[c] = detail::sum_chunk<Iterator, T>(chunk_start, chunk_length, mode);
+                if (c + 1 < chunk_last)
+                    std::advance(chunk_start, chunk_length);
+            }
+        }
+        catch (...)
+        {
+            errors[i] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> threads(num_threads - 1);
+    {
+        join_threads joiner(threads);
+        for (unsigned long i = 1; i < num_threads; ++i)
+            threads[i - 1] = std::thread(sum_chunks, i);
+        sum_chunks(0);
+    }
+
+    for (auto const &error : errors)
+        if (error)
+            std::rethrow_exception(error);
+    return init + detail::combine_tree(partials, 0, num_chunks);
+}
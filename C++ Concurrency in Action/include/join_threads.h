@@ -0,0 +1,30 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+
+/*** 8.4.2 Exception safety: join_threads
+ *
+ * parallel_accumulate from 2.4 leaks running threads (std::terminate) if anything throws
+ * between launching and joining. join_threads joins whatever is joinable on the way out.
+*/
+
+class join_threads
+{
+    std::vector<std::thread> &threads;
+
+public:
+    explicit join_threads(std::vector<std::thread> &threads_) : threads(threads_) {}
+
+    ~join_threads()
+    {
+        for (auto &entry : threads)
+        {
+            if (entry.joinable())
+                entry.join();
+        }
+    }
+
+    join_threads(join_threads const &) = delete;
+    join_threads &operator=(join_threads const &) = delete;
+};
@@ -0,0 +1,678 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <ostream>
+#include <span>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "thread_wrappers.h"
+
+/*** parallel_accumulate from 2.4
+ *
+ * accumulate_block (vectorized for contiguous arithmetic ranges, 2.4.1), the block split for
+ * random-access and forward-only ranges (2.4.2) and the fixed-size overloads (2.4.3).
+*/
+
+/** 2.4.1 Vectorizing accumulate_block
+ *
+ * std::accumulate adds one element at a time into one variable, so every add waits for the
+ * previous one (3-4 cycles of latency). For floating point the compiler must not reorder
+ * the sum, so it won't vectorize it either.
+ *
+ * For contiguous ranges of float, double, int32_t and int64_t, accumulate_block instead
+ * keeps four independent vector accumulators and combines them at the end:
+ *
+ *  - AVX-512 (64-byte vectors) or AVX2 (32-byte) picked at runtime with __builtin_cpu_supports
+ *  - 16-byte vectors otherwise: SSE2 on x86-64, NEON on AArch64
+ *
+ * Reassociation mode: this changes the order of additions. Integers get the same answer
+ * (wrapping on overflow). Floating point sums can differ from std::accumulate in the last
+ * bits; parallel_accumulate already splits the sum into blocks, so it was never
+ * bit-identical to the serial version anyway. Define ACCUMULATE_BLOCK_STRICT_FP to keep
+ * std::accumulate order for float and double.
+*/
+
+#if defined(__GNUC__)
+
+template <typename T, std::size_t Bytes>
+[[gnu::always_inline]] inline T vector_sum(T const *p, std::size_t n, T init)
+{
+    typedef T vec __attribute__((vector_size(Bytes)));
+    constexpr std::size_t width = Bytes / sizeof(T);
+
+    vec a0{}, a1{}, a2{}, a3{};
+    vec v0, v1, v2, v3;
+    std::size_t i = 0;
+    for (; i + 4 * width <= n; i += 4 * width)
+    {
+        std::memcpy(&v0, p + i, sizeof(vec)); // unaligned loads
+        std::memcpy(&v1, p + i + width, sizeof(vec));
+        std::memcpy(&v2, p + i + 2 * width, sizeof(vec));
+        std::memcpy(&v3, p + i + 3 * width, sizeof(vec));
+        a0 += v0;
+        a1 += v1;
+        a2 += v2;
+        a3 += v3;
+    }
+    for (; i + width <= n; i += width)
+    {
+        std::memcpy(&v0, p + i, sizeof(vec));
+        a0 += v0;
+    }
+    a0 = (a0 + a1) + (a2 + a3);
+
+    T result = init;
+    for (std::size_t j = 0; j < width; ++j)
+        result += a0[j];
+    for (; i != n; ++i)
+        result += p[i];
+    return result;
+}
+
+template <typename T>
+struct simd_sum
+{
+#if defined(__x86_64__) || defined(__i386__)
+    [[gnu::target("avx512f")]] static T avx512(T const *p, std::size_t n, T init)
+    {
+        return vector_sum<T, 64>(p, n, init);
+    }
+
+    [[gnu::target("avx2")]] static T avx2(T const *p, std::size_t n, T init)
+    {
+        return vector_sum<T, 32>(p, n, init);
+    }
+#endif
+
+    static T base(T const *p, std::size_t n, T init)
+    {
+        return vector_sum<T, 16>(p, n, init);
+    }
+};
+
+template <typename T>
+T simd_accumulate(T const *p, std::size_t n, T init)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static auto const kernel = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return &simd_sum<T>::avx512;
+        if (__builtin_cpu_supports("avx2"))
+            return &simd_sum<T>::avx2;
+        return &simd_sum<T>::base;
+    }();
+    return kernel(p, n, init);
+#else
+    return simd_sum<T>::base(p, n, init);
+#endif
+}
+
+template <typename Iterator, typename T>
+constexpr bool simd_accumulable =
+    std::contiguous_iterator<Iterator> &&
+    std::is_same_v<std::iter_value_t<Iterator>, T> &&
+    (std::is_same_v<T, std::int32_t> || std::is_same_v<T, std::int64_t>
+#if !defined(ACCUMULATE_BLOCK_STRICT_FP)
+     || std::is_same_v<T, float> || std::is_same_v<T, double>
+#endif
+    );
+
+#else
+
+template <typename Iterator, typename T>
+constexpr bool simd_accumulable = false;
+
+template <typename T>
+T simd_accumulate(T const *, std::size_t, T init) { return init; }
+
+#endif
+
+/** Profiling parallel_accumulate
+ *
+ * When parallel_accumulate doesn't scale, the causes look the same from outside: slow thread
+ * startup, unequal blocks, memory bandwidth, or the serial combine at the end. Build with
+ * -DACCUMULATE_PROFILE and install an accumulate_trace to see which one it is; without the
+ * macro call_recorder is empty and every hook compiles away, like thread_metrics above.
+ *
+ *  - per call, one slot per block: when the thread was launched (or the task submitted),
+ *    when accumulate_block started and ended, and how many elements it had
+ *  - on the calling thread: the join tail (own block done until every block is done and
+ *    joined) and the final combine
+ *  - slots are written by their own thread without locking and handed to the trace once,
+ *    after the joins, so recording doesn't add contention to what it measures
+ *  - timestamps are rdtsc ticks on x86, steady_clock nanoseconds elsewhere; the trace maps
+ *    them to time when it's written
+ *
+ * write_chrome_trace() emits trace-event JSON (chrome://tracing, ui.perfetto.dev open it),
+ * one track per block slot. print_summary() gives per-call busy and idle time per slot.
+*/
+
+namespace accumulate_profile
+{
+    inline std::uint64_t ticks() noexcept
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+    }
+}
+
+struct accumulate_span
+{
+    std::uint64_t launched = 0; // thread created / task submitted
+    std::uint64_t begin = 0;    // accumulate_block called
+    std::uint64_t end = 0;
+    std::uint64_t elements = 0;
+};
+
+struct accumulate_call
+{
+    std::uint64_t begin = 0;
+    std::uint64_t own_block_done = 0; // join tail: own_block_done .. joined
+    std::uint64_t joined = 0;
+    std::uint64_t end = 0;            // combine: joined .. end
+    std::vector<accumulate_span> blocks;
+};
+
+class accumulate_trace
+{
+    mutable std::mutex m;
+    std::vector<accumulate_call> calls;
+    std::uint64_t const origin_ticks = accumulate_profile::ticks();
+    std::chrono::steady_clock::time_point const origin_time = std::chrono::steady_clock::now();
+
+    double ticks_per_us() const
+    {
+        double const elapsed_us = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - origin_time).count();
+        double const elapsed_ticks = static_cast<double>(accumulate_profile::ticks() - origin_ticks);
+        return elapsed_us > 0.0 && elapsed_ticks > 0.0 ? elapsed_ticks / elapsed_us : 1.0;
+    }
+
+public:
+    void add(accumulate_call call)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        calls.push_back(std::move(call));
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lk(m);
+        calls.clear();
+    }
+
+    std::vector<accumulate_call> snapshot() const
+    {
+        std::lock_guard<std::mutex> lk(m);
+        return calls;
+    }
+
+    void write_chrome_trace(std::ostream &out) const
+    {
+        std::vector<accumulate_call> const recorded = snapshot();
+        double const scale = ticks_per_us();
+        auto const us = [&](std::uint64_t t) { return static_cast<double>(t - origin_ticks) / scale; };
+
+        char const *separator = "";
+        auto const event = [&](char const *name, std::size_t call, std::size_t slot,
+                               std::uint64_t from, std::uint64_t to, std::uint64_t elements) {
+            if (to < from)
+                return;
+            out << separator << "\n{\"name\":\"" << name << "\",\"cat\":\"parallel_accumulate\","
+                << "\"ph\":\"X\",\"pid\":1,\"tid\":" << slot << ",\"ts\":" << us(from)
+                << ",\"dur\":" << static_cast<double>(to - from) / scale
+                << ",\"args\":{\"call\":" << call << ",\"elements\":" << elements << "}}";
+            separator = ",";
+        };
+
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        for (std::size_t c = 0; c < recorded.size(); ++c)
+        {
+            accumulate_call const &call = recorded[c];
+            for (std::size_t slot = 0; slot < call.blocks.size(); ++slot)
+            {
+                accumulate_span const &block = call.blocks[slot];
+                if (block.launched != block.begin)
+                    event("startup", c, slot, block.launched, block.begin, 0);
+                event("block", c, slot, block.begin, block.end, block.elements);
+            }
+            std::size_t const caller = call.blocks.empty() ? 0 : call.blocks.size() - 1;
+            event("join tail", c, caller, call.own_block_done, call.joined, 0);
+            event("combine", c, caller, call.joined, call.end, call.blocks.size());
+        }
+        out << "\n]}\n";
+    }
+
+    // Busy: inside accumulate_block. Idle: the rest of the call, startup and waiting included
+    void print_summary(std::ostream &out) const
+    {
+        std::vector<accumulate_call> const recorded = snapshot();
+        double const scale = ticks_per_us();
+        for (std::size_t c = 0; c < recorded.size(); ++c)
+        {
+            accumulate_call const &call = recorded[c];
+            double const wall = static_cast<double>(call.end - call.begin) / scale;
+            out << "call " << c << ": " << call.blocks.size() << " blocks, " << wall << " us, join tail "
+                << static_cast<double>(call.joined - call.own_block_done) / scale << " us, combine "
+                << static_cast<double>(call.end - call.joined) / scale << " us\n";
+            for (std::size_t slot = 0; slot < call.blocks.size(); ++slot)
+            {
+                accumulate_span const &block = call.blocks[slot];
+                double const busy = static_cast<double>(block.end - block.begin) / scale;
+                out << "  slot " << slot << ": startup "
+                    << static_cast<double>(block.begin - block.launched) / scale << " us, busy " << busy
+                    << " us, idle " << wall - busy << " us\n";
+            }
+        }
+    }
+};
+
+namespace accumulate_profile
+{
+    inline std::atomic<accumulate_trace *> &trace()
+    {
+        static std::atomic<accumulate_trace *> current{nullptr};
+        return current;
+    }
+
+#if defined(ACCUMULATE_PROFILE)
+    // One per parallel_accumulate call; records nothing while no trace is installed
+    class call_recorder
+    {
+        accumulate_trace *const target = trace().load(std::memory_order_acquire);
+        accumulate_call call;
+
+    public:
+        explicit call_recorder(std::size_t blocks)
+        {
+            if (target)
+            {
+                call.begin = ticks();
+                call.blocks.resize(blocks);
+            }
+        }
+
+        std::uint64_t now() const noexcept { return target ? ticks() : 0; }
+
+        // From the thread running block i only; launched 0: it runs on the calling thread
+        template <typename Block>
+        void time_block(std::size_t i, std::uint64_t launched, std::uint64_t elements, Block &&block)
+        {
+            if (!target)
+            {
+                block();
+                return;
+            }
+            accumulate_span &span = call.blocks[i];
+            span.elements = elements;
+            span.begin = ticks();
+            span.launched = launched != 0 ? launched : span.begin;
+            block();
+            span.end = ticks();
+        }
+
+        void own_block_done() noexcept { call.own_block_done = now(); }
+        void joined() noexcept { call.joined = now(); }
+
+        void finished()
+        {
+            if (!target)
+                return;
+            call.end = ticks();
+            target->add(std::move(call));
+        }
+    };
+#else
+    class call_recorder
+    {
+    public:
+        explicit call_recorder(std::size_t) {}
+
+        std::uint64_t now() const noexcept { return 0; }
+
+        template <typename Block>
+        void time_block(std::size_t, std::uint64_t, std::uint64_t, Block &&block) { block(); }
+
+        void own_block_done() noexcept {}
+        void joined() noexcept {}
+        void finished() {}
+    };
+#endif
+}
+
+// nullptr stops recording. The trace must outlive every call that may still be recording.
+inline void set_accumulate_trace(accumulate_trace *trace)
+{
+    accumulate_profile::trace().store(trace, std::memory_order_release);
+}
+
+// A naïve parallel version of std::accumulate
+
+template<typename Iterator, typename T>
+struct accumulate_block{
+    void operator() (Iterator first, Iterator last, T& result){
+        if constexpr (simd_accumulable<Iterator, T>)
+            result = simd_accumulate(std::to_address(first),
+                                     static_cast<std::size_t>(last - first), result);
+        else
+            result = std::accumulate(first, last, result);
+    }
+};
+
+template<typename Iterator, typename T>
+T parallel_accumulate(Iterator first, Iterator last, T init,
+                      std::random_access_iterator_tag){
+    unsigned long const length = last - first;
+    
+    if(!length)
+        return init;
+    
+    unsigned long const min_per_thread = 25;
+    unsigned long const max_threads = 
+                (length+min_per_thread-1)/min_per_thread;
+    unsigned long const hardware_threads = 
+                std::thread::hardware_concurrency();
+    unsigned long const num_threads =
+                std::min(hardware_threads != 0 ? hardware_threads:2, max_threads);
+    unsigned long const block_size = length / num_threads;
+
+    std::vector<T> results(num_threads);
+    std::vector<std::thread> threads(num_threads - 1);
+    spin_latch blocks_done(static_cast<std::ptrdiff_t>(num_threads - 1));
+    accumulate_profile::call_recorder profile(num_threads);
+    Iterator block_start = first;
+    
+    for (unsigned long i = 0; i < (num_threads - 1); ++i)
+    {
+        Iterator const block_end = block_start + block_size; // O(1), no walk
+        threads[i] = std::thread(
+            [&blocks_done, &profile, i, launched = profile.now(), block_start, block_end,
+             &result = results[i]] {
+                profile.time_block(i, launched, block_end - block_start, [&] {
+                    accumulate_block<Iterator, T>()(block_start, block_end, result);
+                });
+                blocks_done.count_down();
+            });
+        block_start = block_end;
+    }
+    profile.time_block(num_threads - 1, 0, last - block_start, [&] {
+        accumulate_block<Iterator, T>()(block_start, last, results[num_threads - 1]);
+    });
+    profile.own_block_done();
+    blocks_done.wait(); // the blocks are the same size, they usually finish close together
+    for (auto &entry : threads)
+        entry.join();
+    profile.joined();
+    T const result = std::accumulate(results.begin(), results.end(), init);
+    profile.finished();
+    return result;
+}
+
+/** 2.4.2 Splitting forward-only ranges
+ * 
+ * For a std::list, std::distance and every std::advance walk the nodes, so the launching
+ * thread traverses the whole range once before the first worker even starts.
+ * 
+ * Forward iterators get a pipelined version instead:
+ *  - the launching thread walks the range once, cutting it into chunks of
+ *    forward_chunk_size elements, and queues each chunk as soon as its end is found
+ *  - a worker is started per queued chunk, up to hardware_concurrency() - 1, so a range
+ *    shorter than one chunk never starts a thread
+ *  - once the walk is done the launching thread takes the tail and then helps drain the queue
+ *  - partials are kept per chunk and combined in range order, like results above
+ *  - the first exception from any chunk is rethrown after all workers are joined
+*/
+
+unsigned long const forward_chunk_size = 4096;
+
+template<typename Iterator, typename T>
+T parallel_accumulate(Iterator first, Iterator last, T init,
+                      std::forward_iterator_tag){
+    struct chunk
+    {
+        Iterator first;
+        Iterator last;
+        T *result;
+    };
+
+    std::mutex m;
+    std::condition_variable chunk_ready;
+    std::deque<chunk> chunks;
+    std::deque<T> results; // push_back keeps references to existing elements valid
+    bool walk_done = false;
+    std::exception_ptr error;
+
+    auto run_chunks = [&] {
+        std::unique_lock<std::mutex> lk(m);
+        for (;;)
+        {
+            chunk_ready.wait(lk, [&] { return walk_done || !chunks.empty(); });
+            if (chunks.empty())
+                return;
+            chunk c = chunks.front();
+            chunks.pop_front();
+            lk.unlock();
+            try
+            {
+                accumulate_block<Iterator, T>()(c.first, c.last, *c.result);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> guard(m);
+                if (!error)
+                    error = std::current_exception();
+            }
+            lk.lock();
+        }
+    };
+
+    unsigned long const hardware_threads = std::thread::hardware_concurrency();
+    unsigned long const max_workers = (hardware_threads != 0 ? hardware_threads : 2) - 1;
+    std::vector<std::thread> threads;
+
+    struct finish_and_join // also on the way out of an exception from the walk
+    {
+        std::mutex &m;
+        std::condition_variable &chunk_ready;
+        bool &walk_done;
+        std::vector<std::thread> &threads;
+        ~finish_and_join()
+        {
+            {
+                std::lock_guard<std::mutex> lk(m);
+                walk_done = true;
+            }
+            chunk_ready.notify_all();
+            for (auto &entry : threads)
+                entry.join();
+        }
+    } joiner{m, chunk_ready, walk_done, threads};
+
+    Iterator block_start = first;
+    while (block_start != last)
+    {
+        Iterator block_end = block_start;
+        unsigned long n = 0;
+        while (n != forward_chunk_size && block_end != last)
+        {
+            ++block_end;
+            ++n;
+        }
+        {
+            std::lock_guard<std::mutex> lk(m);
+            results.emplace_back();
+            chunks.push_back(chunk{block_start, block_end, &results.back()});
+        }
+        if (block_end == last)
+            break;
+        chunk_ready.notify_one();
+        if (threads.size() < max_workers)
+            threads.emplace_back(run_chunks);
+        block_start = block_end;
+    }
+    {
+        std::lock_guard<std::mutex> lk(m);
+        walk_done = true;
+    }
+    chunk_ready.notify_all();
+    run_chunks(); // the tail, plus whatever the workers haven't picked up yet
+    for (auto &entry : threads)
+        entry.join();
+    threads.clear();
+
+    if (error)
+        std::rethrow_exception(error);
+    return std::accumulate(results.begin(), results.end(), init);
+}
+
+template<typename Iterator, typename T>
+T parallel_accumulate(Iterator first, Iterator last, T init){
+    return parallel_accumulate(first, last, init,
+        typename std::iterator_traits<Iterator>::iterator_category());
+}
+
+
+/** 2.4.3 Fixed-size ranges
+ *
+ * For a std::array (or a built-in array, or a std::span with a static extent) the length is
+ * a compile-time constant, yet parallel_accumulate above still works out the partition at
+ * runtime and puts results and threads in two heap-allocated vectors on every call. For
+ * small frames summed at a high rate, those allocations cost more than the sum.
+ *
+ * The overloads below take the range itself and decide from N at compile time:
+ *
+ *  - N <= fixed_unroll_limit: one fold expression, fully unrolled. Same left-to-right order
+ *    as std::accumulate
+ *  - N < fixed_parallel_threshold: accumulate_block on the calling thread (vectorized for
+ *    contiguous ints and floating point). A few thousand elements take about a microsecond,
+ *    much less than launching even one thread
+ *  - otherwise the 2.4 algorithm, with at most fixed_max_blocks(N) blocks known at compile
+ *    time, so results and threads are std::arrays on the stack. Only the thread count is
+ *    left to runtime: hardware_concurrency() is read once and cached
+ *
+ * All of it is constexpr: in a constant expression the two larger cases use std::accumulate.
+*/
+
+constexpr std::size_t fixed_unroll_limit = 32;
+constexpr std::size_t fixed_parallel_threshold = std::size_t(1) << 18;
+
+// min_per_thread from 2.4, and never more than 64 stack slots
+constexpr std::size_t fixed_max_blocks(std::size_t n)
+{
+    return std::min<std::size_t>((n + 25 - 1) / 25, 64);
+}
+
+namespace detail
+{
+    template <typename Element, std::size_t N, typename T, std::size_t... I>
+    constexpr T unrolled_accumulate(std::span<Element, N> values, T init, std::index_sequence<I...>)
+    {
+        ((init = init + values[I]), ...);
+        return init;
+    }
+
+    inline unsigned long cached_hardware_threads()
+    {
+        static unsigned long const hardware_threads = std::thread::hardware_concurrency();
+        return hardware_threads != 0 ? hardware_threads : 2;
+    }
+}
+
+template <typename Element, std::size_t N, typename T>
+    requires(N != std::dynamic_extent)
+constexpr T parallel_accumulate(std::span<Element, N> values, T init)
+{
+    using iterator = typename std::span<Element, N>::iterator;
+
+    if constexpr (N <= fixed_unroll_limit)
+    {
+        return detail::unrolled_accumulate(values, init, std::make_index_sequence<N>());
+    }
+    else
+    {
+        if (std::is_constant_evaluated())
+            return std::accumulate(values.begin(), values.end(), init);
+
+        if constexpr (N < fixed_parallel_threshold)
+        {
+            accumulate_block<iterator, T>()(values.begin(), values.end(), init);
+            return init;
+        }
+        else
+        {
+            constexpr std::size_t max_blocks = fixed_max_blocks(N);
+            std::size_t const num_threads =
+                std::min<std::size_t>(detail::cached_hardware_threads(), max_blocks);
+            std::size_t const block_size = N / num_threads;
+
+            std::array<T, max_blocks> results{};
+            std::array<std::thread, max_blocks - 1> threads;
+            spin_latch blocks_done(static_cast<std::ptrdiff_t>(num_threads - 1));
+            accumulate_profile::call_recorder profile(num_threads);
+
+            for (std::size_t i = 0; i < (num_threads - 1); ++i)
+            {
+                iterator const block_start = values.begin() + i * block_size;
+                threads[i] = std::thread(
+                    [&blocks_done, &profile, i, launched = profile.now(), block_start, block_size,
+                     &result = results[i]] {
+                        profile.time_block(i, launched, block_size, [&] {
+                            accumulate_block<iterator, T>()(block_start, block_start + block_size, result);
+                        });
+                        blocks_done.count_down();
+                    });
+            }
+            iterator const tail = values.begin() + (num_threads - 1) * block_size;
+            profile.time_block(num_threads - 1, 0, values.end() - tail, [&] {
+                accumulate_block<iterator, T>()(tail, values.end(), results[num_threads - 1]);
+            });
+            profile.own_block_done();
+            blocks_done.wait();
+            for (std::size_t i = 0; i < (num_threads - 1); ++i)
+                threads[i].join();
+            profile.joined();
+            T const result = std::accumulate(results.begin(), results.begin() + num_threads, init);
+            profile.finished();
+            return result;
+        }
+    }
+}
+
+template <typename Element, std::size_t N, typename T>
+constexpr T parallel_accumulate(std::array<Element, N> const &values, T init)
+{
+    return parallel_accumulate(std::span<Element const, N>(values), init);
+}
+
+template <typename Element, std::size_t N, typename T>
+constexpr T parallel_accumulate(Element const (&values)[N], T init)
+{
+    return parallel_accumulate(std::span<Element const, N>(values), init);
+}
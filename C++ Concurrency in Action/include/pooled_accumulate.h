@@ -0,0 +1,230 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <future>
+#include <iterator>
+#include <numeric>
+#include <vector>
+
+#include "parallel_accumulate.h"
+#include "thread_pool.h"
+
+/** 9.1.2 parallel_accumulate on a thread pool
+ *
+ * parallel_accumulate from 2.4 pays for num_threads - 1 thread launches on every call, and
+ * results is a plain std::vector<T>: neighbouring partial sums share a cache line, so every
+ * accumulate_block write bounces that line between cores (false sharing, see 8.2.3).
+ *
+ *  - blocks are submitted to a long-lived pool; the calling thread still runs the last block
+ *  - each partial gets its own cache line through padded<T>
+ *  - the original (first, last, init) signature is untouched, this is an overload
+*/
+
+// Fixed rather than std::hardware_destructive_interference_size: that one depends on -mtune,
+// and GCC warns when it ends up in a layout
+constexpr std::size_t cache_line_size = 64;
+
+template <typename T>
+struct alignas(cache_line_size) padded
+{
+    T value;
+};
+
+namespace detail
+{
+    template <typename Iterator, typename T>
+    T pooled_accumulate(thread_pool &pool, Iterator first, Iterator last,
+                        unsigned long length, T init, unsigned long grain_size)
+    {
+        if (!length)
+            return init;
+
+        unsigned long const max_blocks =
+            (length + grain_size - 1) / grain_size;
+        unsigned long const num_blocks =
+            std::min<unsigned long>(pool.size() != 0 ? pool.size() : 1, max_blocks);
+        unsigned long const block_size = length / num_blocks;
+
+        std::vector<padded<T>> results(num_blocks);
+        std::vector<std::future<void>> futures(num_blocks - 1);
+        accumulate_profile::call_recorder profile(num_blocks); // launched = submitted
+        Iterator block_start = first;
+
+        try
+        {
+            for (unsigned long i = 0; i < (num_blocks - 1); ++i)
+            {
+                Iterator block_end = block_start;
+                std::advance(block_end, block_size);
+                futures[i] = pool.submit(
+                    [&profile, i, launched = profile.now(), block_size, block_start, block_end,
+                     &result = results[i].value] {
+                        profile.time_block(i, launched, block_size, [&] {
+                            accumulate_block<Iterator, T>()(block_start, block_end, result);
+                        });
+                    });
+                block_start = block_end;
+            }
+
+            profile.time_block(num_blocks - 1, 0, length - block_size * (num_blocks - 1), [&] {
+                accumulate_block<Iterator, T>()(
+                    block_start, last, results[num_blocks - 1].value);
+            });
+        }
+        catch (...)
+        {
+            // a submit() or the own block threw: the blocks already queued still write into
+            // results and profile, so they have to finish before those go away
+            for (auto &entry : futures)
+                if (entry.valid())
+                    pool.wait(entry);
+            throw;
+        }
+        profile.own_block_done();
+
+        for (auto &entry : futures) // all of them first: a throwing get() would free results
+            pool.wait(entry);
+        for (auto &entry : futures)
+            entry.get();
+        profile.joined();
+
+        T result = init;
+        for (auto const &partial : results)
+            result = result + partial.value;
+        profile.finished();
+        return result;
+    }
+}
+
+// Explicit grain size: no block smaller than grain_size elements
+template <typename Iterator, typename T>
+T parallel_accumulate(thread_pool &pool, Iterator first, Iterator last, T init,
+                      unsigned long grain_size)
+{
+    unsigned long const length = std::distance(first, last);
+    return detail::pooled_accumulate(pool, first, last, length, init,
+                                     std::max(grain_size, 1ul));
+}
+
+// e.g. a transformed block materialized in scratch memory, so accumulate_block still gets a
+// contiguous range of T (the vectorized path for arithmetic T) and nothing touches the heap
+template <typename Iterator, typename T, typename Transform>
+T parallel_transform_accumulate(thread_pool &pool, Iterator first, Iterator last, T init,
+                                Transform transform)
+{
+    unsigned long const length = std::distance(first, last);
+    unsigned long const block_size = std::max(length / std::max(pool.size(), 1u), 1024ul);
+
+    std::vector<std::future<T>> futures;
+    futures.reserve((length + block_size - 1) / block_size); // push_back can't throw below
+    try
+    {
+        for (unsigned long start = 0; start < length; start += block_size)
+        {
+            Iterator const block_start = std::next(first, start);
+            Iterator const block_end = std::next(block_start, std::min(block_size, length - start));
+            futures.push_back(pool.submit([block_start, block_end, &transform] {
+                std::pmr::vector<T> values(this_thread_scratch_resource());
+                values.reserve(std::distance(block_start, block_end));
+                std::transform(block_start, block_end, std::back_inserter(values), transform);
+                T partial = T();
+                accumulate_block<T const *, T>()(values.data(), values.data() + values.size(), partial);
+                return partial;
+            }));
+        }
+    }
+    catch (...)
+    {
+        for (auto &entry : futures) // the blocks already queued still use transform
+            pool.wait(entry);
+        throw;
+    }
+
+    for (auto &entry : futures) // all of them first, they use transform
+        pool.wait(entry);
+    T result = init;
+    for (auto &entry : futures)
+        result = result + entry.get();
+    return result;
+}
+
+/** 9.1.3 Choosing the grain size
+ *
+ * min_per_thread = 25 is a guess that only fits one cost per element. Summing ints costs
+ * about a nanosecond per element, so 25 of them are nothing next to a task dispatch;
+ * an expensive operator+ would want much smaller blocks.
+ *
+ *  - the first call for a given <Iterator, T> with at least 2 * calibration_elements
+ *    elements times accumulate_block on a prefix of the input and caches the cost per
+ *    element. The first calibration_elements only warm up (caches, page faults) and aren't
+ *    timed; both parts count towards the result, nothing is thrown away
+ *  - shorter calls before that are summed on the calling thread and cache nothing: on a
+ *    few elements the clock overhead would be most of the measurement, and below
+ *    calibration_elements even cheap elements don't pay for one task. A caller that only
+ *    ever reduces small vectors never touches the pool
+ *  - that threshold, uncalibrated_grain_size, is also the default grain of pool algorithms
+ *    that have no calibration of their own (parallel_sort, parallel_partition)
+ *  - grain size = enough elements to keep a block busy for target_block_ns
+ *  - the number of blocks is still capped at pool.size()
+ *  - pass grain_size explicitly to skip all of this
+*/
+
+template <typename Iterator, typename T>
+struct accumulate_cost
+{
+    static inline std::atomic<double> ns_per_element{0.0}; // 0 until calibrated
+};
+
+constexpr double target_block_ns = 50000.0;       // well above a submit/steal round trip
+constexpr unsigned long calibration_elements = 4096;
+constexpr unsigned long uncalibrated_grain_size = 2 * calibration_elements;
+
+template <typename Iterator, typename T>
+T parallel_accumulate(thread_pool &pool, Iterator first, Iterator last, T init)
+{
+    unsigned long length = std::distance(first, last);
+
+    if (!length)
+        return init;
+
+    std::atomic<double> &cost = accumulate_cost<Iterator, T>::ns_per_element;
+    double ns_per_element = cost.load(std::memory_order_relaxed);
+
+    if (ns_per_element == 0.0)
+    {
+        if (length < uncalibrated_grain_size)
+        {
+            accumulate_block<Iterator, T>()(first, last, init);
+            return init;
+        }
+
+        Iterator warm_end = first;
+        std::advance(warm_end, calibration_elements);
+        Iterator sample_end = warm_end;
+        std::advance(sample_end, calibration_elements);
+
+        T warm = T(); // same starting value as a results[] slot
+        accumulate_block<Iterator, T>()(first, warm_end, warm);
+
+        T partial = T();
+        auto const start = std::chrono::steady_clock::now();
+        accumulate_block<Iterator, T>()(warm_end, sample_end, partial);
+        auto const elapsed = std::chrono::steady_clock::now() - start;
+
+        ns_per_element = std::max(
+            std::chrono::duration<double, std::nano>(elapsed).count() / calibration_elements, 0.01);
+        cost.store(ns_per_element, std::memory_order_relaxed);
+
+        init = init + warm;
+        init = init + partial;
+        first = sample_end;
+        length -= 2 * calibration_elements;
+    }
+
+    unsigned long const grain_size =
+        std::max(static_cast<unsigned long>(target_block_ns / ns_per_element), 1ul);
+    return detail::pooled_accumulate(pool, first, last, length, init, grain_size);
+}
@@ -0,0 +1,1210 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "thread_wrappers.h"
+
+/*** 9.1 Thread pools
+ *
+ * f() from 2.3 launches a brand-new std::thread per do_work(i) and joins them all. Creating
+ * and tearing down an OS thread costs microseconds, far more than most units of work.
+ *
+ * A thread pool keeps a fixed number of long-lived worker threads (usually one per
+ * hardware_concurrency()) and hands them tasks through queues instead.
+ *
+ *  - submit() wraps the task in a std::packaged_task and returns its std::future
+ *  - the pool joins its workers on destruction, like joining_thread does
+*/
+
+/** 9.1.2 function_wrapper
+ *
+ * std::packaged_task is move-only, std::function requires copyable callables,
+ * so tasks are stored behind a small type-erased move-only wrapper.
+*/
+
+class function_wrapper
+{
+    struct impl_base
+    {
+        virtual void call() = 0;
+        virtual ~impl_base() {}
+    };
+
+    template <typename F>
+    struct impl_type : impl_base
+    {
+        F f;
+        impl_type(F &&f_) : f(std::move(f_)) {}
+        void call() { f(); }
+    };
+
+    std::unique_ptr<impl_base> impl;
+
+public:
+    template <typename F>
+    function_wrapper(F &&f) : impl(new impl_type<F>(std::move(f)))
+    {}
+
+    function_wrapper() = default;
+    function_wrapper(function_wrapper &&other) noexcept : impl(std::move(other.impl)) {}
+
+    function_wrapper &operator=(function_wrapper &&other) noexcept
+    {
+        impl = std::move(other.impl);
+        return *this;
+    }
+
+    void operator()() { impl->call(); }
+
+    function_wrapper(function_wrapper const &) = delete;
+    function_wrapper &operator=(function_wrapper const &) = delete;
+};
+
+/* **************************************************************************************** */
+
+/** 9.1.5 Work stealing
+ *
+ * With a single shared queue every submit and every pop contends on the same lock.
+ * Instead each worker owns a deque:
+ *
+ *  - the owner pushes and pops at the bottom (LIFO, cache-hot, no lock)
+ *  - idle workers steal from the top (FIFO, oldest and usually biggest tasks)
+ *  - submissions from outside the pool go to a global injection queue
+ *
+ * work_stealing_queue is a Chase-Lev deque (Le, Pop, Cohen, Nardelli 2013, C11 version).
+ * Only the owning thread may call push() and pop(); any thread may call steal().
+ * The ring grows when full; old rings are retired, not freed, because a thief may still
+ * be reading from them. They're released with the queue.
+*/
+
+class work_stealing_queue
+{
+    struct ring
+    {
+        std::int64_t const capacity;
+        std::int64_t const mask;
+        std::unique_ptr<std::atomic<function_wrapper *>[]> slots;
+
+        explicit ring(std::int64_t capacity_) : capacity(capacity_), mask(capacity_ - 1),
+                                              slots(new std::atomic<function_wrapper *>[capacity_])
+        {}
+
+        function_wrapper *get(std::int64_t i) const
+        {
+            return slots[i & mask].load(std::memory_order_relaxed);
+        }
+
+        void put(std::int64_t i, function_wrapper *task)
+        {
+            slots[i & mask].store(task, std::memory_order_relaxed);
+        }
+
+        ring *grow(std::int64_t bottom, std::int64_t top) const
+        {
+            ring *bigger = new ring(capacity * 2);
+            for (std::int64_t i = top; i != bottom; ++i)
+                bigger->put(i, get(i));
+            return bigger;
+        }
+    };
+
+    std::atomic<std::int64_t> top;
+    std::atomic<std::int64_t> bottom;
+    std::atomic<ring *> array;
+    std::vector<std::unique_ptr<ring>> retired; // touched by the owner only
+
+public:
+    explicit work_stealing_queue(std::int64_t capacity = 256) // must be a power of two
+        : top(0), bottom(0), array(new ring(capacity))
+    {}
+
+    ~work_stealing_queue()
+    {
+        while (function_wrapper *task = pop())
+            delete task;
+        delete array.load(std::memory_order_relaxed);
+    }
+
+    work_stealing_queue(work_stealing_queue const &) = delete;
+    work_stealing_queue &operator=(work_stealing_queue const &) = delete;
+
+    void push(function_wrapper *task)
+    {
+        std::int64_t const b = bottom.load(std::memory_order_relaxed);
+        std::int64_t const t = top.load(std::memory_order_acquire);
+        ring *a = array.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1)
+        {
+            retired.emplace_back(a);
+            a = a->grow(b, t);
+            array.store(a, std::memory_order_release);
+        }
+        a->put(b, task);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    function_wrapper *pop()
+    {
+        std::int64_t const b = bottom.load(std::memory_order_relaxed) - 1;
+        ring *a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t t = top.load(std::memory_order_relaxed);
+
+        if (t > b) // empty
+        {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        function_wrapper *task = a->get(b);
+        if (t == b) // last element: race against thieves for it
+        {
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                             std::memory_order_relaxed))
+                task = nullptr;
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    function_wrapper *steal()
+    {
+        std::int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t const b = bottom.load(std::memory_order_acquire);
+
+        if (t >= b)
+            return nullptr;
+
+        ring *a = array.load(std::memory_order_acquire);
+        function_wrapper *task = a->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed))
+            return nullptr; // lost the race to the owner or another thief
+        return task;
+    }
+};
+
+/** 9.1.6 Machine topology and NUMA placement
+ *
+ * hardware_concurrency() is a single number. On a multi-socket machine each socket has its
+ * own memory controller, and a thread reading memory attached to the other socket pays
+ * extra latency and shares the inter-socket link bandwidth.
+ *
+ * cpu_topology reads what Linux exposes under /sys:
+ *
+ *  - /sys/devices/system/node/online: the node numbers, which needn't be contiguous
+ *  - /sys/devices/system/node/nodeN/cpulist: which logical CPUs belong to NUMA node N
+ *  - /sys/devices/system/cpu/cpuN/topology/{physical_package_id,core_id}: socket and core.
+ *    core_id is only unique within a socket
+ *  - /sys/devices/system/cpu/cpuN/topology/thread_siblings_list: the SMT siblings of cpuN,
+ *    the logical CPUs sharing its core (cpuN included)
+ *
+ * The pool pins by node only; sockets, cores and siblings are there for placement that
+ * wants one worker per physical core (cpus_per_core()) or per socket (cpus_on_socket()).
+ *
+ * Nodes without CPUs (memory-only, e.g. CXL or HBM) are left out: nothing can be pinned
+ * there. The rest are numbered 0..node_count-1 in the order Linux lists them; node_index()
+ * maps a Linux node number (as numa_node_of() returns it) to that index.
+ *
+ * If /sys isn't there (not Linux, containers with it masked) everything is one node and
+ * one socket with hardware_concurrency() CPUs, each its own core, and pinning becomes a
+ * no-op. detect() takes the sysfs root so a fake tree can stand in for it.
+*/
+
+struct cpu_topology
+{
+    struct cpu
+    {
+        unsigned id;
+        unsigned socket;                // physical_package_id
+        unsigned core;                  // core_id, unique within the socket
+        unsigned node;                  // index into os_nodes
+        std::vector<unsigned> siblings; // SMT siblings, including id itself
+    };
+
+    std::vector<cpu> cpus;
+    std::vector<unsigned> os_nodes{0}; // Linux node number of each node with CPUs
+    unsigned node_count = 1;
+    unsigned socket_count = 1;
+
+    // -1 for nodes without CPUs and nodes Linux doesn't list
+    int node_index(unsigned os_node) const noexcept
+    {
+        auto const found = std::find(os_nodes.begin(), os_nodes.end(), os_node);
+        return found == os_nodes.end() ? -1 : static_cast<int>(found - os_nodes.begin());
+    }
+
+    std::vector<unsigned> cpus_on_node(unsigned node) const
+    {
+        std::vector<unsigned> ids;
+        for (auto const &c : cpus)
+            if (c.node == node)
+                ids.push_back(c.id);
+        return ids;
+    }
+
+    std::vector<unsigned> cpus_on_socket(unsigned socket) const
+    {
+        std::vector<unsigned> ids;
+        for (auto const &c : cpus)
+            if (c.socket == socket)
+                ids.push_back(c.id);
+        return ids;
+    }
+
+    // The first SMT sibling of every physical core: one CPU per core
+    std::vector<unsigned> cpus_per_core() const
+    {
+        std::vector<unsigned> ids;
+        for (auto const &c : cpus)
+            if (c.siblings.empty() || c.siblings.front() == c.id)
+                ids.push_back(c.id);
+        return ids;
+    }
+
+    cpu const *find_cpu(unsigned id) const noexcept
+    {
+        auto const found = std::find_if(cpus.begin(), cpus.end(),
+                                        [id](cpu const &c) { return c.id == id; });
+        return found == cpus.end() ? nullptr : &*found;
+    }
+
+    static std::vector<unsigned> parse_cpulist(std::string const &list) // "0-3,8-11"
+    {
+        std::vector<unsigned> ids;
+        std::istringstream in(list);
+        std::string range;
+        while (std::getline(in, range, ','))
+        {
+            if (range.empty() || !std::isdigit(static_cast<unsigned char>(range[0])))
+                continue;
+            std::size_t const dash = range.find('-');
+            unsigned const lo = std::stoul(range.substr(0, dash));
+            unsigned const hi = dash == std::string::npos ? lo : std::stoul(range.substr(dash + 1));
+            for (unsigned id = lo; id <= hi; ++id)
+                ids.push_back(id);
+        }
+        return ids;
+    }
+
+    static std::string read_line(std::string const &path)
+    {
+        std::ifstream in(path);
+        std::string line;
+        std::getline(in, line);
+        return line;
+    }
+
+    static unsigned read_number(std::string const &path, unsigned fallback)
+    {
+        std::string const line = read_line(path);
+        if (line.empty() || !std::isdigit(static_cast<unsigned char>(line[0])))
+            return fallback;
+        return std::stoul(line);
+    }
+
+    static cpu_topology detect(std::string const &sys_root = "/sys/devices/system/")
+    {
+        cpu_topology topology;
+        topology.os_nodes.clear();
+        std::string const node_root = sys_root + "node/";
+
+        for (unsigned os_node : parse_cpulist(read_line(node_root + "online"))) // same format
+        {
+            std::vector<unsigned> const ids =
+                parse_cpulist(read_line(node_root + "node" + std::to_string(os_node) + "/cpulist"));
+            if (ids.empty())
+                continue; // memory-only node
+            unsigned const node = static_cast<unsigned>(topology.os_nodes.size());
+            topology.os_nodes.push_back(os_node);
+            for (unsigned id : ids)
+            {
+                std::string const base =
+                    sys_root + "cpu/cpu" + std::to_string(id) + "/topology/";
+                std::vector<unsigned> siblings = parse_cpulist(read_line(base + "thread_siblings_list"));
+                if (siblings.empty())
+                    siblings.push_back(id);
+                topology.cpus.push_back(cpu{id, read_number(base + "physical_package_id", 0),
+                                            read_number(base + "core_id", id), node,
+                                            std::move(siblings)});
+            }
+        }
+
+        if (topology.cpus.empty())
+        {
+            unsigned const hardware_threads = std::thread::hardware_concurrency();
+            for (unsigned id = 0; id < (hardware_threads != 0 ? hardware_threads : 2); ++id)
+                topology.cpus.push_back(cpu{id, 0, id, 0, {id}});
+            topology.os_nodes.assign(1, 0);
+        }
+        topology.node_count = static_cast<unsigned>(topology.os_nodes.size());
+
+        std::vector<unsigned> sockets;
+        for (auto const &c : topology.cpus)
+            if (std::find(sockets.begin(), sockets.end(), c.socket) == sockets.end())
+                sockets.push_back(c.socket);
+        topology.socket_count = static_cast<unsigned>(sockets.size());
+        return topology;
+    }
+};
+
+// Pins the calling thread to the given CPUs; false if the platform doesn't support it
+inline bool pin_current_thread(std::vector<unsigned> const &cpu_ids)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (unsigned id : cpu_ids)
+        CPU_SET(id, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu_ids;
+    return false;
+#endif
+}
+
+// NUMA node holding the page at p, or -1 if unknown or not yet faulted in
+inline int numa_node_of(void const *p)
+{
+#if defined(__linux__) && defined(SYS_move_pages)
+    static long const page_size = sysconf(_SC_PAGESIZE);
+    void *page = reinterpret_cast<void *>(
+        reinterpret_cast<std::uintptr_t>(p) & ~static_cast<std::uintptr_t>(page_size - 1));
+    int status = -1;
+    if (syscall(SYS_move_pages, 0, 1ul, &page, nullptr, &status, 0) == 0 && status >= 0)
+        return status;
+#else
+    (void)p;
+#endif
+    return -1;
+}
+
+/** Per-thread scratch memory
+ *
+ * Tasks that build temporary buffers (a transformed block, a vector of matches...) all go
+ * through the global heap, so with many workers malloc's locks show up next to the compute.
+ *
+ * scratch_arena is a bump allocator owned by one thread: allocation moves a pointer,
+ * deallocation does nothing, and the whole arena is rewound at once.
+ *
+ *  - this_thread_scratch_resource() wraps it as a std::pmr::memory_resource, so
+ *    std::pmr::vector and friends can use it directly
+ *  - scratch_scope rewinds to where it started when it goes out of scope; scopes nest, so
+ *    a task that runs another task while waiting (run_pending_task) keeps its own memory
+ *  - thread_pool opens a scratch_scope around every task: whatever a task allocates here is
+ *    gone when it returns. Don't hand arena memory to anything that outlives the task.
+ *  - chunks are kept after a rewind, so a warmed-up worker doesn't touch the heap again
+ *
+ * A plain std::thread (the 2.4 workers, the do_work fan-out) can open its own scratch_scope.
+*/
+
+class scratch_arena
+{
+    struct chunk
+    {
+        std::unique_ptr<std::byte[]> memory;
+        std::size_t size;
+    };
+
+    static constexpr std::size_t first_chunk_size = 64 * 1024;
+
+    std::vector<chunk> chunks;
+    std::size_t current = 0; // chunk being bumped
+    std::size_t offset = 0;
+
+public:
+    struct marker
+    {
+        std::size_t chunk;
+        std::size_t offset;
+    };
+
+    scratch_arena() = default;
+    scratch_arena(scratch_arena const &) = delete;
+    scratch_arena &operator=(scratch_arena const &) = delete;
+
+    void *allocate(std::size_t bytes, std::size_t alignment)
+    {
+        for (; current < chunks.size(); ++current, offset = 0)
+        {
+            auto const base = reinterpret_cast<std::uintptr_t>(chunks[current].memory.get());
+            std::uintptr_t const start = (base + offset + alignment - 1) & ~(alignment - 1);
+            if (start + bytes <= base + chunks[current].size)
+            {
+                offset = start + bytes - base;
+                return reinterpret_cast<void *>(start);
+            }
+        }
+
+        std::size_t const size = std::max(chunks.empty() ? first_chunk_size : 2 * chunks.back().size,
+                                          bytes + alignment);
+        chunks.push_back(chunk{std::make_unique<std::byte[]>(size), size});
+        current = chunks.size() - 1;
+        offset = 0;
+        return allocate(bytes, alignment);
+    }
+
+    marker mark() const noexcept
+    {
+        return marker{current, offset};
+    }
+
+    void rewind(marker m) noexcept
+    {
+        current = m.chunk;
+        offset = m.offset;
+    }
+
+    std::size_t reserved_bytes() const noexcept
+    {
+        std::size_t total = 0;
+        for (auto const &c : chunks)
+            total += c.size;
+        return total;
+    }
+};
+
+class scratch_resource : public std::pmr::memory_resource
+{
+    scratch_arena &arena;
+
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        return arena.allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(std::pmr::memory_resource const &other) const noexcept override
+    {
+        return this == &other;
+    }
+
+public:
+    explicit scratch_resource(scratch_arena &arena_) : arena(arena_) {}
+};
+
+inline scratch_arena &this_thread_scratch()
+{
+    thread_local scratch_arena arena;
+    return arena;
+}
+
+inline std::pmr::memory_resource *this_thread_scratch_resource()
+{
+    thread_local scratch_resource resource(this_thread_scratch());
+    return &resource;
+}
+
+class scratch_scope
+{
+    scratch_arena &arena;
+    scratch_arena::marker start;
+
+public:
+    scratch_scope() : arena(this_thread_scratch()), start(arena.mark()) {}
+    ~scratch_scope() { arena.rewind(start); }
+
+    scratch_scope(scratch_scope const &) = delete;
+    scratch_scope &operator=(scratch_scope const &) = delete;
+};
+
+/** The pool itself
+ *
+ *  - pending counts tasks that are queued but not yet taken; idle workers sleep on
+ *    work_available until it's non-zero, so an idle pool burns no CPU
+ *  - submit() from a worker pushes onto that worker's own deque, from anywhere else onto
+ *    the global queue
+ *  - run_pending_task() lets a task that waits on another future help out instead of
+ *    blocking a worker (otherwise a pool can deadlock on its own subtasks)
+ *  - the destructor drains queued tasks before joining, so no future is left broken
+ *
+ * With pool_options::pin_to_numa_nodes the workers are spread round-robin over the NUMA
+ * nodes and pinned to that node's CPUs. submit_to_node() then queues a task for the
+ * workers of one node; they look there before the global queue. Only they take it, never a
+ * worker of another node, since first-touch placement depends on where it runs. Node
+ * tasks aren't counted in pending (other nodes' workers would spin on them); a worker also
+ * wakes for its own node's queue, and the first worker of a node is started as soon as a
+ * task is queued there. A node left without workers (fewer threads than nodes) gets its
+ * tasks through the global queue instead.
+ *
+ * Startup cost and idle footprint:
+ *
+ *  - warm_threads: only that many workers start in the constructor (the warm-up phase); the
+ *    others start one at a time when a task is pushed and there are fewer sleeping workers
+ *    than pending tasks. size() always reports the full thread_count
+ *  - stack_size: an explicit, usually much smaller, stack than glibc's 8 MB default. Workers
+ *    are native_threads (2.3), so the size applies to them only, never to threads other
+ *    code creates at the same time
+ *  - prefault_stack_bytes / prefault_scratch_bytes: each worker touches that much of its
+ *    stack and of its scratch_arena before taking work, so the page faults happen during
+ *    warm-up rather than on the first task. The stack part is clamped to the space left
+ *    below the worker's current frame (prefaultable_stack_bytes), never overflowing it
+ *
+ * submit_bulk(range, fn) runs fn(element) for every element of a random-access range:
+ *
+ *  - the elements are cut into chunks (grain elements each, by default about four chunks per
+ *    worker) and every chunk becomes one task, not every element
+ *  - the chunks are queued under one lock with one fetch_add on pending, and only as many
+ *    sleeping workers as there are chunks are woken
+ *  - one bulk_handle tracks the whole batch: wait() (which helps when called on a worker),
+ *    get() rethrows the first exception. Chunks not yet started are skipped after a failure
+ *  - like parallel_for_each, the range is referenced, not copied: it (and fn's captures)
+ *    must outlive the batch
+*/
+
+// Who the current thread is, set once when a pool or scheduler starts the thread
+enum class thread_role
+{
+    unassigned,
+    master,
+    worker
+};
+
+struct execution_context
+{
+    thread_role role = thread_role::unassigned;
+    unsigned index = 0;
+};
+
+inline thread_local execution_context this_thread_context;
+
+struct pool_options
+{
+    unsigned thread_count = 0; // 0: one per hardware thread
+    bool pin_to_numa_nodes = false;
+    unsigned warm_threads = ~0u;         // started up front; default: all of them
+    std::size_t stack_size = 0;          // 0: platform default
+    std::size_t prefault_stack_bytes = 0;
+    std::size_t prefault_scratch_bytes = 0;
+};
+
+// Touches bytes of the calling thread's stack a page at a time, in one frame of that size
+[[gnu::noinline]] inline void prefault_stack(std::size_t bytes)
+{
+    if (bytes == 0)
+        return;
+#if defined(__GNUC__)
+    volatile char *const area = static_cast<volatile char *>(__builtin_alloca(bytes));
+    for (std::size_t offset = 0; offset < bytes; offset += 4096)
+        area[offset] = 0;
+    area[bytes - 1] = 0;
+#else
+    volatile char page[4096];
+    page[0] = 0;
+    if (bytes > sizeof(page))
+        prefault_stack(bytes - sizeof(page));
+    page[sizeof(page) - 1] = page[0]; // used after the call: no tail call reusing the frame
+#endif
+}
+
+// How much of the calling thread's stack prefault_stack may use. Where the stack can be read
+// (pthread_getattr_np), that's the space left between the current frame and the lowest
+// address of the stack: whatever the thread already used above us, which sanitizers make
+// hundreds of KB, is never counted as free. Otherwise stack_size (asked for) stands in for
+// it, with a fixed allowance for the frames already in use
+inline std::size_t prefaultable_stack_bytes(std::size_t requested, std::size_t stack_size)
+{
+    constexpr std::size_t reserved = 64 * 1024; // frames below this one, signal handlers
+#if defined(__GLIBC__)
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0)
+    {
+        void *lowest = nullptr;
+        std::size_t size = 0;
+        int const err = pthread_attr_getstack(&attr, &lowest, &size);
+        pthread_attr_destroy(&attr);
+        if (err == 0 && lowest != nullptr)
+        {
+            auto const here = reinterpret_cast<std::uintptr_t>(__builtin_frame_address(0));
+            auto const bottom = reinterpret_cast<std::uintptr_t>(lowest);
+            std::size_t const left = here > bottom + reserved ? here - bottom - reserved : 0;
+            return std::min(requested, left);
+        }
+    }
+#endif
+    if (stack_size == 0)
+        return requested; // unknown: trust the caller
+    std::size_t const usable = stack_size > reserved ? (stack_size - reserved) / 8 * 7 : 0;
+    return std::min(requested, usable);
+}
+
+class thread_pool;
+
+namespace detail
+{
+    struct bulk_state
+    {
+        std::atomic<std::size_t> remaining; // chunks not finished yet
+        std::atomic<bool> failed{false};
+        std::mutex error_mutex;
+        std::exception_ptr error;
+        std::size_t const count;
+
+        bulk_state(std::size_t chunks, std::size_t count_) : remaining(chunks), count(count_) {}
+
+        void record_failure()
+        {
+            std::lock_guard<std::mutex> lk(error_mutex);
+            if (!error)
+                error = std::current_exception();
+            failed = true;
+        }
+
+        void chunk_done(std::size_t chunks = 1)
+        {
+            if (remaining.fetch_sub(chunks, std::memory_order_acq_rel) == chunks)
+                remaining.notify_all();
+        }
+    };
+}
+
+// Completion of one submit_bulk() batch. Like std::future, a default-constructed handle has
+// no state: everything but valid() throws std::future_error(no_state) on it
+class bulk_handle
+{
+    thread_pool *pool = nullptr;
+    std::shared_ptr<detail::bulk_state> state;
+
+    detail::bulk_state &checked_state() const
+    {
+        if (!state)
+            throw std::future_error(std::future_errc::no_state);
+        return *state;
+    }
+
+public:
+    bulk_handle() = default;
+
+    bulk_handle(thread_pool &pool_, std::shared_ptr<detail::bulk_state> state_)
+        : pool(&pool_), state(std::move(state_))
+    {}
+
+    bool valid() const noexcept
+    {
+        return state != nullptr;
+    }
+
+    bool is_ready() const
+    {
+        return checked_state().remaining.load(std::memory_order_acquire) == 0;
+    }
+
+    // Number of elements in the batch
+    std::size_t size() const
+    {
+        return checked_state().count;
+    }
+
+    void wait() const;
+
+    // Rethrows the first exception fn threw. Can be called repeatedly.
+    void get() const
+    {
+        wait();
+        if (state->error) // wait() checked state
+            std::rethrow_exception(state->error);
+    }
+};
+
+class thread_pool
+{
+    std::atomic<bool> done;
+    std::atomic<std::size_t> pending;
+    std::mutex global_mutex;
+    std::condition_variable work_available;
+    std::deque<function_wrapper *> global_queue;
+    std::vector<std::deque<function_wrapper *>> node_queues; // guarded by global_mutex
+    std::vector<std::unique_ptr<work_stealing_queue>> queues;
+    std::vector<unsigned> worker_node;
+    std::vector<native_thread> threads;
+    cpu_topology topology;
+    bool pinned;
+    pool_options options;
+    unsigned idle_workers = 0;  // guarded by global_mutex
+    std::mutex spawn_mutex;
+    bool spawning_closed = false; // guarded by spawn_mutex
+    std::atomic<unsigned> started{0};
+
+    static inline thread_local work_stealing_queue *local_queue = nullptr;
+    static inline thread_local thread_pool *local_pool = nullptr;
+    static inline thread_local unsigned local_index = 0;
+
+    static unsigned default_thread_count()
+    {
+        unsigned const hardware_threads = std::thread::hardware_concurrency();
+        return hardware_threads != 0 ? hardware_threads : 2;
+    }
+
+    // Start more workers if the ones sleeping can't take that many tasks right away. Throws
+    // only if no worker is running at all: then the tasks would never run.
+    void start_worker_if_needed(std::size_t tasks = 1)
+    {
+        if (started.load(std::memory_order_acquire) == queues.size())
+            return;
+        std::size_t spare = 0;
+        {
+            std::lock_guard<std::mutex> lk(global_mutex);
+            std::size_t const queued = pending.load(std::memory_order_relaxed);
+            if (idle_workers > queued)
+                spare = idle_workers - queued;
+        }
+        try
+        {
+            for (std::size_t i = spare; i < tasks; ++i)
+                if (!start_worker())
+                    break;
+        }
+        catch (...)
+        {
+            if (started.load(std::memory_order_acquire) == 0)
+                throw;
+        }
+    }
+
+    // false once every worker is running or the pool is shutting down
+    bool start_worker()
+    {
+        std::lock_guard<std::mutex> lk(spawn_mutex);
+        unsigned const index = started.load(std::memory_order_relaxed);
+        if (spawning_closed || index == queues.size())
+            return false;
+        threads.emplace_back(options.stack_size, [this, index] { worker_thread(index); });
+        started.store(index + 1, std::memory_order_release);
+        return true;
+    }
+
+    // The queue owns the task only once the push succeeded; if anything throws, task still does
+    void push_task(std::unique_ptr<function_wrapper> &task)
+    {
+        start_worker_if_needed();
+        if (local_pool == this)
+        {
+            pending.fetch_add(1, std::memory_order_release);
+            try
+            {
+                local_queue->push(task.get());
+            }
+            catch (...)
+            {
+                pending.fetch_sub(1, std::memory_order_relaxed);
+                throw;
+            }
+            task.release();
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lk(global_mutex);
+            global_queue.push_back(task.get());
+            task.release();
+            pending.fetch_add(1, std::memory_order_release); // no pop before this, we hold the lock
+        }
+        {
+            std::lock_guard<std::mutex> lk(global_mutex); // pairs with the wait in worker_thread
+        }
+        work_available.notify_one();
+    }
+
+    void push_task_to_node(std::unique_ptr<function_wrapper> &task, unsigned node)
+    {
+        node %= static_cast<unsigned>(node_queues.size());
+        if (node >= queues.size()) // worker i is on node i % node_count
+        {
+            push_task(task);
+            return;
+        }
+        while (started.load(std::memory_order_acquire) <= node) // that node's first worker
+            if (!start_worker())
+                break;
+        {
+            std::lock_guard<std::mutex> lk(global_mutex);
+            node_queues[node].push_back(task.get());
+            task.release();
+        }
+        work_available.notify_all(); // notify_one might wake a worker on another node
+    }
+
+    // push_task() for a whole batch: one reservation, one lock, as few wakeups as possible.
+    // Takes ownership of the tasks it queued; if it throws, the ones left in tasks are not.
+    void push_tasks(std::vector<function_wrapper *> &tasks)
+    {
+        start_worker_if_needed(tasks.size());
+        std::size_t const count = tasks.size();
+        std::size_t sleeping = 0;
+        if (local_pool == this)
+        {
+            pending.fetch_add(count, std::memory_order_release);
+            std::size_t pushed = 0;
+            try
+            {
+                for (; pushed < count; ++pushed)
+                    local_queue->push(tasks[pushed]); // throws only if the deque can't grow
+            }
+            catch (...)
+            {
+                pending.fetch_sub(count - pushed, std::memory_order_relaxed);
+                tasks.erase(tasks.begin(), tasks.begin() + static_cast<std::ptrdiff_t>(pushed));
+                throw;
+            }
+            std::lock_guard<std::mutex> lk(global_mutex); // pairs with the wait in worker_thread
+            sleeping = idle_workers;
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lk(global_mutex);
+            global_queue.insert(global_queue.end(), tasks.begin(), tasks.end());
+            pending.fetch_add(tasks.size(), std::memory_order_release); // no pop before this
+            sleeping = idle_workers;
+        }
+        if (count >= sleeping)
+            work_available.notify_all();
+        else
+            for (std::size_t i = 0; i < count; ++i)
+                work_available.notify_one();
+    }
+
+    // Not counted in pending; only this pool's workers on that node may take these
+    function_wrapper *pop_task_from_node_queue()
+    {
+        if (local_pool != this)
+            return nullptr;
+        std::lock_guard<std::mutex> lk(global_mutex);
+        auto &queue = node_queues[worker_node[local_index]];
+        if (queue.empty())
+            return nullptr;
+        function_wrapper *task = queue.front();
+        queue.pop_front();
+        return task;
+    }
+
+    function_wrapper *pop_task_from_global_queue()
+    {
+        std::lock_guard<std::mutex> lk(global_mutex);
+        if (global_queue.empty())
+            return nullptr;
+        function_wrapper *task = global_queue.front();
+        global_queue.pop_front();
+        return task;
+    }
+
+    function_wrapper *pop_task_from_other_thread_queue()
+    {
+        for (unsigned i = 0; i < queues.size(); ++i)
+        {
+            unsigned const index = (local_index + i + 1) % queues.size();
+            if (function_wrapper *task = queues[index]->steal())
+                return task;
+        }
+        return nullptr;
+    }
+
+    function_wrapper *take_task()
+    {
+        function_wrapper *task = nullptr;
+        if (local_queue)
+            task = local_queue->pop();
+        if (!task)
+        {
+            if (function_wrapper *node_task = pop_task_from_node_queue())
+                return node_task; // not counted in pending
+            task = pop_task_from_global_queue();
+        }
+        if (!task)
+            task = pop_task_from_other_thread_queue();
+        if (task)
+            pending.fetch_sub(1, std::memory_order_acq_rel);
+        return task;
+    }
+
+    // Scratch memory the task allocated is released after the task itself is destroyed
+    static void run_task(function_wrapper *task)
+    {
+        scratch_scope scratch;
+        std::unique_ptr<function_wrapper> owned(task);
+        (*owned)();
+    }
+
+    void worker_thread(unsigned index)
+    {
+        if (pinned)
+            pin_current_thread(topology.cpus_on_node(worker_node[index]));
+        local_index = index;
+        local_queue = queues[index].get();
+        local_pool = this;
+        this_thread_context = execution_context{thread_role::worker, index};
+        if (options.prefault_stack_bytes)
+            prefault_stack(prefaultable_stack_bytes(options.prefault_stack_bytes, options.stack_size));
+        if (options.prefault_scratch_bytes)
+        {
+            scratch_scope scratch;
+            std::memset(this_thread_scratch().allocate(options.prefault_scratch_bytes, 1), 0,
+                        options.prefault_scratch_bytes);
+        }
+
+        for (;;)
+        {
+            if (function_wrapper *task = take_task())
+            {
+                run_task(task);
+                continue;
+            }
+            if (pending.load(std::memory_order_acquire) != 0)
+            {
+                std::this_thread::yield(); // a task is mid-push or mid-steal elsewhere
+                continue;
+            }
+            std::unique_lock<std::mutex> lk(global_mutex);
+            auto const &node_queue = node_queues[worker_node[index]];
+            if (!node_queue.empty())
+                continue;
+            ++idle_workers;
+            work_available.wait(lk, [this, &node_queue] {
+                return done.load() || pending.load(std::memory_order_acquire) != 0 ||
+                       !node_queue.empty();
+            });
+            --idle_workers;
+            if (done.load() && pending.load(std::memory_order_acquire) == 0 && node_queue.empty())
+                return;
+        }
+    }
+
+    template <typename FunctionType, typename... Args>
+    static auto package_task(FunctionType &&f, Args &&...args)
+    {
+        using result_type = std::invoke_result_t<std::decay_t<FunctionType>, std::decay_t<Args>...>;
+        std::packaged_task<result_type()> task(
+            [f = std::forward<FunctionType>(f),
+             tup = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+                return std::apply(std::move(f), std::move(tup));
+            });
+        std::future<result_type> res(task.get_future());
+        return std::make_pair(std::make_unique<function_wrapper>(std::move(task)), std::move(res));
+    }
+
+public:
+    explicit thread_pool(unsigned thread_count = default_thread_count())
+        : thread_pool(pool_options{thread_count, false})
+    {}
+
+    explicit thread_pool(pool_options const &options_)
+        : done(false), pending(0),
+          topology(options_.pin_to_numa_nodes ? cpu_topology::detect() : cpu_topology()),
+          pinned(options_.pin_to_numa_nodes), options(options_)
+    {
+        unsigned const thread_count =
+            options.thread_count != 0 ? options.thread_count : default_thread_count();
+        node_queues.resize(topology.node_count);
+        try
+        {
+            for (unsigned i = 0; i < thread_count; ++i)
+            {
+                queues.push_back(std::make_unique<work_stealing_queue>());
+                worker_node.push_back(i % topology.node_count);
+            }
+            threads.reserve(thread_count);
+            for (unsigned i = 0; i < std::min(thread_count, options.warm_threads); ++i)
+                start_worker();
+        }
+        catch (...)
+        {
+            shut_down();
+            throw;
+        }
+    }
+
+    ~thread_pool()
+    {
+        shut_down();
+        for (function_wrapper *task : global_queue)
+            delete task;
+        for (auto &node_queue : node_queues)
+            for (function_wrapper *task : node_queue)
+                delete task;
+    }
+
+    thread_pool(thread_pool const &) = delete;
+    thread_pool &operator=(thread_pool const &) = delete;
+
+    void shut_down()
+    {
+        {
+            std::lock_guard<std::mutex> lk(spawn_mutex);
+            spawning_closed = true; // threads doesn't change from here on
+        }
+        {
+            std::lock_guard<std::mutex> lk(global_mutex);
+            done = true;
+        }
+        work_available.notify_all();
+        for (auto &entry : threads)
+            if (entry.joinable())
+                entry.join();
+    }
+
+    unsigned size() const noexcept
+    {
+        return static_cast<unsigned>(queues.size());
+    }
+
+    unsigned node_count() const noexcept
+    {
+        return static_cast<unsigned>(node_queues.size());
+    }
+
+    // The submit_to_node() index for a Linux node number; -1 if no worker can be pinned there
+    int node_index(unsigned os_node) const noexcept
+    {
+        return pinned ? topology.node_index(os_node) : -1;
+    }
+
+    template <typename FunctionType, typename... Args>
+    std::future<std::invoke_result_t<std::decay_t<FunctionType>, std::decay_t<Args>...>>
+    submit(FunctionType &&f, Args &&...args)
+    {
+        auto [task, res] = package_task(std::forward<FunctionType>(f), std::forward<Args>(args)...);
+        push_task(task);
+        return std::move(res);
+    }
+
+    // Run on a worker pinned to the given NUMA node (plain submit() for unpinned pools)
+    template <typename FunctionType, typename... Args>
+    std::future<std::invoke_result_t<std::decay_t<FunctionType>, std::decay_t<Args>...>>
+    submit_to_node(unsigned node, FunctionType &&f, Args &&...args)
+    {
+        auto [task, res] = package_task(std::forward<FunctionType>(f), std::forward<Args>(args)...);
+        if (pinned)
+            push_task_to_node(task, node);
+        else
+            push_task(task);
+        return std::move(res);
+    }
+
+    // fn(element) for every element; see bulk_handle. grain 0: about four chunks per worker
+    template <std::ranges::random_access_range Range, typename Fn>
+    bulk_handle submit_bulk(Range &&range, Fn fn, std::size_t grain = 0)
+    {
+        auto const first = std::ranges::begin(range);
+        std::size_t const count = static_cast<std::size_t>(std::ranges::distance(range));
+        if (grain == 0)
+            grain = std::max<std::size_t>((count + 4 * queues.size() - 1) / (4 * queues.size()), 1);
+        std::size_t const chunks = (count + grain - 1) / grain;
+
+        auto state = std::make_shared<detail::bulk_state>(chunks, count);
+        if (chunks == 0)
+            return bulk_handle(*this, std::move(state));
+        auto body = std::make_shared<Fn const>(std::move(fn));
+        std::vector<function_wrapper *> tasks;
+        try
+        {
+            tasks.reserve(chunks);
+            for (std::size_t from = 0; from < count; from += grain)
+            {
+                auto const begin = first + from;
+                auto const end = first + std::min(from + grain, count);
+                tasks.push_back(new function_wrapper([state, body, begin, end] {
+                    if (!state->failed.load(std::memory_order_relaxed))
+                    {
+                        try
+                        {
+                            for (auto it = begin; it != end; ++it)
+                                (*body)(*it);
+                        }
+                        catch (...)
+                        {
+                            state->record_failure();
+                        }
+                    }
+                    state->chunk_done();
+                }));
+            }
+            push_tasks(tasks);
+        }
+        catch (...)
+        {
+            for (function_wrapper *task : tasks)
+                delete task;
+            throw;
+        }
+        return bulk_handle(*this, std::move(state));
+    }
+
+    void run_pending_task()
+    {
+        if (function_wrapper *task = take_task())
+            run_task(task);
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    // Block on f, but keep a worker busy with other tasks while it waits
+    template <typename ResultType>
+    void wait(std::future<ResultType> &f)
+    {
+        if (local_pool != this)
+        {
+            f.wait();
+            return;
+        }
+        while (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            run_pending_task();
+    }
+
+    bool is_worker_thread() const noexcept
+    {
+        return local_pool == this;
+    }
+};
+
+
+inline void bulk_handle::wait() const
+{
+    detail::bulk_state &batch = checked_state();
+    if (pool->is_worker_thread())
+    {
+        while (!is_ready())
+            pool->run_pending_task();
+        return;
+    }
+    for (std::size_t left = batch.remaining.load(std::memory_order_acquire); left != 0;
+         left = batch.remaining.load(std::memory_order_acquire))
+        batch.remaining.wait(left, std::memory_order_acquire);
+}
@@ -0,0 +1,904 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*** Thread wrappers from chapter 2
+ *
+ * thread_guard, scoped_thread, joining_thread and native_thread, with the lifecycle metrics
+ * they report, the launch options joining_thread applies and launch_owning for passing
+ * large buffers. The notes in "02- Managing Threads.cpp" walk through how they came about.
+*/
+
+/** Thread lifecycle metrics
+ * 
+ * To find out where join stalls come from: how long creating a thread takes, how long the
+ * callable runs, how long the owner then blocks in join(), and how many threads the
+ * wrappers own at once. Build with -DTHREAD_METRICS to turn it on; without it the hooks
+ * below are empty and live_thread_token is an empty member, so nothing is left in the binary.
+ * 
+ *  - thread_metrics_sink is the interface; every callback defaults to doing nothing
+ *  - thread_stats is the built-in sink: atomic counters plus log2 histograms in nanoseconds
+ *  - set_thread_metrics_sink() installs another one (e.g. forwarding to a metrics library);
+ *    sinks must be thread-safe and outlive every instrumented thread
+ * 
+ * thread_guard and scoped_thread get threads that already exist, so they only report join
+ * waits and the live gauge. joining_thread launches its own and reports everything.
+*/
+
+struct thread_metrics_sink
+{
+    virtual ~thread_metrics_sink() = default;
+    virtual void thread_created(std::chrono::nanoseconds /*creation_cost*/) {}
+    virtual void thread_finished(std::chrono::nanoseconds /*runtime*/) {}
+    virtual void thread_joined(std::chrono::nanoseconds /*join_wait*/) {}
+    virtual void live_threads_changed(long /*live*/) {}
+};
+
+class log2_histogram
+{
+    std::array<std::atomic<std::uint64_t>, 64> buckets{}; // bucket i: [2^(i-1), 2^i) ns
+
+public:
+    void record(std::chrono::nanoseconds value) noexcept
+    {
+        auto const ns = static_cast<std::uint64_t>(std::max<std::int64_t>(value.count(), 0));
+        buckets[std::min<std::size_t>(std::bit_width(ns), buckets.size() - 1)]
+            .fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::uint64_t bucket(std::size_t i) const noexcept
+    {
+        return buckets[i].load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t count() const noexcept
+    {
+        std::uint64_t total = 0;
+        for (auto const &b : buckets)
+            total += b.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    void print(std::ostream &out, char const *name) const
+    {
+        out << name << " (" << count() << ")\n";
+        for (std::size_t i = 0; i < buckets.size(); ++i)
+            if (std::uint64_t const n = bucket(i))
+                out << "  < " << (std::uint64_t(1) << i) << " ns: " << n << "\n";
+    }
+};
+
+class thread_stats : public thread_metrics_sink
+{
+public:
+    log2_histogram creation_cost;
+    log2_histogram runtime;
+    log2_histogram join_wait;
+    std::atomic<long> live{0};
+    std::atomic<long> peak_live{0};
+
+    void thread_created(std::chrono::nanoseconds d) override { creation_cost.record(d); }
+    void thread_finished(std::chrono::nanoseconds d) override { runtime.record(d); }
+    void thread_joined(std::chrono::nanoseconds d) override { join_wait.record(d); }
+
+    void live_threads_changed(long now_live) override
+    {
+        live.store(now_live, std::memory_order_relaxed);
+        long peak = peak_live.load(std::memory_order_relaxed);
+        while (now_live > peak && !peak_live.compare_exchange_weak(peak, now_live))
+        {}
+    }
+
+    void print(std::ostream &out) const
+    {
+        out << "live threads: " << live << " (peak " << peak_live << ")\n";
+        creation_cost.print(out, "creation cost");
+        runtime.print(out, "runtime");
+        join_wait.print(out, "join wait");
+    }
+};
+
+namespace thread_metrics
+{
+    inline thread_stats &default_stats()
+    {
+        static thread_stats stats;
+        return stats;
+    }
+
+    inline std::atomic<thread_metrics_sink *> &sink()
+    {
+        static std::atomic<thread_metrics_sink *> current{&default_stats()};
+        return current;
+    }
+
+    inline std::atomic<long> &live_count()
+    {
+        static std::atomic<long> live{0};
+        return live;
+    }
+
+#if defined(THREAD_METRICS)
+    using time_point = std::chrono::steady_clock::time_point;
+    inline time_point now() { return std::chrono::steady_clock::now(); }
+
+    inline void created(time_point start) { sink().load()->thread_created(now() - start); }
+    inline void finished(time_point start) { sink().load()->thread_finished(now() - start); }
+    inline void joined(time_point start) { sink().load()->thread_joined(now() - start); }
+    inline void live_changed(long delta)
+    {
+        sink().load()->live_threads_changed(live_count().fetch_add(delta) + delta);
+    }
+
+    // wraps the callable so the new thread times itself
+    template<typename Callable>
+    auto timed(Callable &&func)
+    {
+        return [f = std::forward<Callable>(func)](auto &&... args) mutable {
+            struct report_runtime
+            {
+                time_point const start = now();
+                ~report_runtime() { finished(start); }
+            } timer;
+            return std::invoke(f, std::forward<decltype(args)>(args)...);
+        };
+    }
+#else
+    struct time_point {};
+    inline time_point now() { return {}; }
+
+    inline void created(time_point) {}
+    inline void finished(time_point) {}
+    inline void joined(time_point) {}
+    inline void live_changed(long) {}
+
+    template<typename Callable>
+    Callable &&timed(Callable &&func) { return std::forward<Callable>(func); }
+#endif
+}
+
+inline void set_thread_metrics_sink(thread_metrics_sink *sink)
+{
+    thread_metrics::sink().store(sink ? sink : &thread_metrics::default_stats());
+}
+
+// Counts one owned thread in the live gauge for as long as it's held
+class live_thread_token
+{
+#if defined(THREAD_METRICS)
+    bool held = false;
+
+public:
+    live_thread_token() = default;
+    explicit live_thread_token(bool acquire_now) { if (acquire_now) acquire(); }
+    live_thread_token(live_thread_token &&other) noexcept : held(std::exchange(other.held, false)) {}
+    live_thread_token &operator=(live_thread_token &&other) noexcept
+    {
+        release();
+        held = std::exchange(other.held, false);
+        return *this;
+    }
+    ~live_thread_token() { release(); }
+
+    void acquire() { if (!held) { held = true; thread_metrics::live_changed(+1); } }
+    void release() { if (held) { held = false; thread_metrics::live_changed(-1); } }
+    void swap(live_thread_token &other) noexcept { std::swap(held, other.held); }
+#else
+public:
+    live_thread_token() = default;
+    explicit live_thread_token(bool) {}
+
+    void acquire() {}
+    void release() {}
+    void swap(live_thread_token &) noexcept {}
+#endif
+};
+
+// One way to achieve this to use RAII
+
+class thread_guard
+{
+    std::thread &t;
+    [[no_unique_address]] live_thread_token live;
+
+public:
+    explicit thread_guard(std::thread &t_) : t(t_), live(t_.joinable()) {}
+
+    ~thread_guard()
+    {
+        if (t.joinable())
+        {
+            auto const start = thread_metrics::now();
+            t.join();
+            thread_metrics::joined(start);
+        }
+    }
+
+    thread_guard(thread_guard const &) = delete;            // copy constructor
+    thread_guard &operator=(thread_guard const &) = delete; // copy assignment
+    /* copy constructor and assignment is dangerous because it might outlive 
+        the scope of the thread it was joining.*/
+};
+
+/** Cooperative cancellation
+ * 
+ * scoped_thread and joining_thread block in their destructors until the callable returns,
+ * however long that takes. With a std::stop_source they ask first, then join:
+ * 
+ *  - scoped_thread takes the std::stop_source whose token was handed to the thread
+ *  - joining_thread owns one, like std::jthread: if the callable accepts a std::stop_token
+ *    as its first parameter it gets one, and the destructor calls request_stop()
+ *  - std::stop_callback registered on the token runs on request_stop(), e.g. to wake a
+ *    thread blocked on a condition variable or a socket
+ * 
+ * The callable still has to check stop_requested(); shutdown is as fast as its loop.
+*/
+
+class scoped_thread
+{
+    std::thread t;
+    std::stop_source stop;
+    [[no_unique_address]] live_thread_token live;
+
+public:
+    explicit scoped_thread(std::thread t_) : t(std::move(t_)), stop(std::nostopstate)
+    {
+        if (!t.joinable())
+            throw std::logic_error("No thread");
+        live.acquire();
+    }
+    scoped_thread(std::thread t_, std::stop_source stop_) : t(std::move(t_)), stop(std::move(stop_))
+    {
+        if (!t.joinable())
+            throw std::logic_error("No thread");
+        live.acquire();
+    }
+    ~scoped_thread()
+    {
+        stop.request_stop(); // no-op without a stop state
+        auto const start = thread_metrics::now();
+        t.join();
+        thread_metrics::joined(start);
+    }
+    scoped_thread(scoped_thread const &) = delete;
+    scoped_thread &operator=(scoped_thread const &) = delete;
+};
+
+/** Launch options for joining_thread
+ * 
+ * Pinning, priority and naming through native_handle() happen after the thread already
+ * started running, so it may run briefly on the wrong core. With thread_launch_options
+ * they're applied by the new thread itself before it calls the callable:
+ * 
+ *  - cpus: affinity mask (pthread_setaffinity_np)
+ *  - sched_policy / sched_priority: e.g. SCHED_FIFO, needs CAP_SYS_NICE
+ *  - nice: per-thread nice level (Linux only: threads have their own nice value)
+ *  - name: visible in top -H, gdb, perf; truncated to 15 characters
+ *  - stack_size: std::thread has no way to pass pthread attributes, so a joining_thread
+ *    with a stack size runs on a native_thread (below): pthread_create with its own
+ *    pthread_attr_t, so no other thread creation is affected. It isn't a std::thread then,
+ *    and as_thread() returns an empty one. thread_pool (9.1) starts its workers the same way
+ * 
+ * The constructor waits until the options are applied. If any of them fails, the callable
+ * never runs and the constructor throws std::system_error.
+*/
+
+struct thread_launch_options
+{
+    std::vector<unsigned> cpus;     // empty: inherit
+    int sched_policy = -1;          // -1: inherit
+    int sched_priority = 0;
+    std::optional<int> nice;
+    std::string name;
+    std::size_t stack_size = 0;     // 0: platform default
+
+    bool empty() const
+    {
+        return cpus.empty() && sched_policy < 0 && !nice && name.empty() && stack_size == 0;
+    }
+};
+
+inline std::error_code apply_launch_options(thread_launch_options const &options)
+{
+#if defined(__linux__)
+    if (!options.cpus.empty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (unsigned id : options.cpus)
+            CPU_SET(id, &set);
+        if (int const err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+            return std::error_code(err, std::system_category());
+    }
+    if (options.sched_policy >= 0)
+    {
+        sched_param param{};
+        param.sched_priority = options.sched_priority;
+        if (int const err = pthread_setschedparam(pthread_self(), options.sched_policy, &param))
+            return std::error_code(err, std::system_category());
+    }
+    if (options.nice)
+    {
+        id_t const tid = static_cast<id_t>(syscall(SYS_gettid));
+        if (setpriority(PRIO_PROCESS, tid, *options.nice) != 0)
+            return std::error_code(errno, std::system_category());
+    }
+    if (!options.name.empty())
+    {
+        if (int const err = pthread_setname_np(pthread_self(), options.name.substr(0, 15).c_str()))
+            return std::error_code(err, std::system_category());
+    }
+    return {};
+#else
+    return options.empty() ? std::error_code()
+                           : std::make_error_code(std::errc::not_supported);
+#endif
+}
+
+// A thread with its own pthread attributes: the stack size goes to this pthread_create call
+// only. Same contract as std::thread: join() or detach() before destruction.
+class native_thread
+{
+#if defined(__linux__)
+    pthread_t handle{};
+    bool running = false;
+
+    template<typename Callable>
+    static void *run(void *state)
+    {
+        std::unique_ptr<Callable> func(static_cast<Callable *>(state));
+        try
+        {
+            (*func)();
+        }
+        catch (...)
+        {
+            std::terminate(); // as std::thread does; nothing may unwind into pthread code
+        }
+        return nullptr;
+    }
+#else
+    std::thread t;
+#endif
+
+public:
+    native_thread() noexcept = default;
+
+    template<typename Callable>
+    native_thread(std::size_t stack_size, Callable &&func)
+    {
+#if defined(__linux__)
+        using callable_type = std::decay_t<Callable>;
+        auto state = std::make_unique<callable_type>(std::forward<Callable>(func));
+        pthread_attr_t attr;
+        if (int const err = pthread_attr_init(&attr))
+            throw std::system_error(err, std::system_category(), "pthread_attr_init");
+        int err = stack_size != 0 ? pthread_attr_setstacksize(&attr, stack_size) : 0;
+        if (!err)
+            err = pthread_create(&handle, &attr, &run<callable_type>, state.get());
+        pthread_attr_destroy(&attr);
+        if (err)
+            throw std::system_error(err, std::system_category(), "pthread_create");
+        state.release(); // the thread owns it now
+        running = true;
+#else
+        if (stack_size != 0)
+            throw std::system_error(std::make_error_code(std::errc::not_supported), "thread stack size");
+        t = std::thread(std::forward<Callable>(func));
+#endif
+    }
+
+#if defined(__linux__)
+    native_thread(native_thread &&other) noexcept
+        : handle(other.handle), running(std::exchange(other.running, false))
+    {}
+
+    native_thread &operator=(native_thread &&other) noexcept
+    {
+        if (running)
+            std::terminate();
+        handle = other.handle;
+        running = std::exchange(other.running, false);
+        return *this;
+    }
+
+    ~native_thread()
+    {
+        if (running)
+            std::terminate();
+    }
+
+    bool joinable() const noexcept { return running; }
+
+    void join()
+    {
+        if (!running)
+            throw std::system_error(std::make_error_code(std::errc::invalid_argument), "native_thread::join");
+        if (int const err = pthread_join(handle, nullptr))
+            throw std::system_error(err, std::system_category(), "pthread_join");
+        running = false;
+    }
+
+    void detach()
+    {
+        if (!running)
+            throw std::system_error(std::make_error_code(std::errc::invalid_argument), "native_thread::detach");
+        pthread_detach(handle);
+        running = false;
+    }
+#else
+    bool joinable() const noexcept { return t.joinable(); }
+    void join() { t.join(); }
+    void detach() { t.detach(); }
+#endif
+};
+
+/** Spin-then-park completion latch
+ * 
+ * std::thread::join() parks the caller in the kernel straight away, even when the thread is
+ * a few microseconds from done, and the wake-up then costs tens of microseconds.
+ * spin_latch counts completions down to zero; wait() first spins for a bounded number of
+ * pause iterations and only then falls back to std::atomic::wait (a futex on Linux).
+ * 
+ *  - the spin budget adapts, shared by all latches: a wait that succeeds while spinning
+ *    at pass i makes the budget at least 2i, a wait that has to park halves it
+ *    (within [min_spin, max_spin])
+ *  - joining_thread has the thread count its own latch down when the callable returns; join()
+ *    waits on that first, so the final std::thread::join() only covers the thread exit
+ *  - parallel_accumulate waits on one latch for all its blocks before joining them
+ * 
+ * thread_guard and scoped_thread receive an already running std::thread, so there's
+ * nothing to hook into; they still join directly.
+*/
+
+inline void cpu_relax() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#else
+    std::this_thread::yield();
+#endif
+}
+
+class spin_latch
+{
+    std::atomic<std::ptrdiff_t> remaining;
+
+    static constexpr unsigned min_spin = 64;
+    static constexpr unsigned max_spin = 16384; // a few microseconds of pause
+    static inline std::atomic<unsigned> spin_budget{1024};
+
+public:
+    explicit spin_latch(std::ptrdiff_t count) : remaining(count) {}
+
+    spin_latch(spin_latch const &) = delete;
+    spin_latch &operator=(spin_latch const &) = delete;
+
+    void count_down(std::ptrdiff_t n = 1) noexcept
+    {
+        if (remaining.fetch_sub(n, std::memory_order_release) == n)
+            remaining.notify_all();
+    }
+
+    bool try_wait() const noexcept
+    {
+        return remaining.load(std::memory_order_acquire) == 0;
+    }
+
+    void wait() const noexcept
+    {
+        unsigned const budget = spin_budget.load(std::memory_order_relaxed);
+        for (unsigned i = 0; i < budget; ++i)
+        {
+            if (try_wait())
+            {
+                if (2 * i > budget)
+                    spin_budget.store(std::min(2 * i, max_spin), std::memory_order_relaxed);
+                return;
+            }
+            cpu_relax();
+        }
+        spin_budget.store(std::max(budget / 2, min_spin), std::memory_order_relaxed);
+
+        for (std::ptrdiff_t current = remaining.load(std::memory_order_acquire); current != 0;
+             current = remaining.load(std::memory_order_acquire))
+            remaining.wait(current, std::memory_order_acquire);
+    }
+};
+
+// Runs f, then counts done down however f exits
+template<typename Callable>
+auto count_down_on_return(std::shared_ptr<spin_latch> done, Callable&& func)
+{
+    return [done = std::move(done), f = std::forward<Callable>(func)](auto&& ... args) mutable {
+        struct signal_done
+        {
+            spin_latch &latch;
+            ~signal_done() { latch.count_down(); }
+        } signal{*done};
+        return std::invoke(f, std::forward<decltype(args)>(args)...);
+    };
+}
+
+template<typename Callable, typename ... Args>
+constexpr bool takes_stop_token =
+    std::is_invocable_v<std::decay_t<Callable>, std::stop_token, std::decay_t<Args>...>;
+
+// joining_thread(deferred_start, f, args...) keeps f and args and only creates the thread on
+// start(), so objects built at startup don't all pay for a thread (and its stack) up front.
+// A deferred thread that's never started never runs f; joinable() is false until start().
+struct deferred_start_t
+{
+    explicit deferred_start_t() = default;
+};
+inline constexpr deferred_start_t deferred_start{};
+
+class joining_thread{
+    std::stop_source stop;
+    [[no_unique_address]] live_thread_token live; // before t: launch() acquires it
+    std::shared_ptr<spin_latch> done;             // null for an adopted std::thread
+    std::thread t;
+    native_thread native;                         // instead of t when launched with a stack size
+    std::thread::id native_id;
+
+    struct pending_launch
+    {
+        virtual ~pending_launch() = default;
+        virtual std::thread launch(joining_thread &self) = 0;
+    };
+
+    template<typename Callable, typename ... Args>
+    struct pending_launch_of : pending_launch
+    {
+        Callable func;
+        std::tuple<Args...> args;
+
+        template<typename F, typename ... A>
+        explicit pending_launch_of(F&& f, A&& ... a):
+            func(std::forward<F>(f)), args(std::forward<A>(a)...)
+        {}
+
+        std::thread launch(joining_thread &self) override {
+            return std::apply([this, &self](auto& ... stored) {
+                return self.launch(std::move(func), std::move(stored)...);
+            }, args);
+        }
+    };
+
+    std::unique_ptr<pending_launch> deferred;
+
+    template<typename Callable, typename ... Args>
+    std::thread launch(Callable&& func, Args&& ... args) {
+        auto const start = thread_metrics::now();
+        done = std::make_shared<spin_latch>(1);
+        auto body = count_down_on_return(done, thread_metrics::timed(std::forward<Callable>(func)));
+        std::thread launched;
+        if constexpr (takes_stop_token<Callable, Args...>)
+            launched = std::thread(std::move(body), stop.get_token(), std::forward<Args>(args)...);
+        else
+            launched = std::thread(std::move(body), std::forward<Args>(args)...);
+        thread_metrics::created(start);
+        live.acquire();
+        return launched;
+    }
+
+public:
+    joining_thread() noexcept = default;
+    template<typename Callable, typename ... Args>
+        requires (!std::is_same_v<std::remove_cvref_t<Callable>, thread_launch_options>)
+    explicit joining_thread(Callable&& func, Args&& ... args):
+        t(launch(std::forward<Callable>(func), std::forward<Args>(args)...))
+    {}
+
+    template<typename Callable, typename ... Args>
+    joining_thread(thread_launch_options const &options, Callable&& func, Args&& ... args)
+    {
+        std::promise<std::error_code> applied;
+        std::future<std::error_code> applied_result = applied.get_future();
+        std::thread::id launched_id; // written before applied is set, read after
+        auto const start = thread_metrics::now();
+        done = std::make_shared<spin_latch>(1);
+        auto body = count_down_on_return(done,
+            [options, applied = std::move(applied), &launched_id, token = stop.get_token(),
+             f = thread_metrics::timed(std::forward<Callable>(func)),
+             tup = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+                std::error_code const err = apply_launch_options(options);
+                launched_id = std::this_thread::get_id();
+                applied.set_value(err);
+                if (err)
+                    return;
+                if constexpr (takes_stop_token<Callable, Args...>)
+                    std::apply(std::move(f), std::tuple_cat(std::make_tuple(std::move(token)),
+                                                            std::move(tup)));
+                else
+                    std::apply(std::move(f), std::move(tup));
+            });
+        if (options.stack_size != 0)
+            native = native_thread(options.stack_size, std::move(body));
+        else
+            t = std::thread(std::move(body));
+        std::error_code const err = applied_result.get();
+        if (err)
+        {
+            if (t.joinable())
+                t.join();
+            else
+                native.join();
+            throw std::system_error(err, "joining_thread launch options");
+        }
+        if (native.joinable())
+            native_id = launched_id;
+        thread_metrics::created(start);
+        live.acquire();
+    }
+
+    template<typename Callable, typename ... Args>
+    joining_thread(deferred_start_t, Callable&& func, Args&& ... args):
+        deferred(std::make_unique<pending_launch_of<std::decay_t<Callable>, std::decay_t<Args>...>>(
+            std::forward<Callable>(func), std::forward<Args>(args)...))
+    {}
+
+    explicit joining_thread(std::thread t_) noexcept:
+        live(t_.joinable()), t(std::move(t_))
+    {}
+
+    joining_thread(joining_thread&& other) noexcept:
+        stop(std::move(other.stop)), live(std::move(other.live)),
+        done(std::move(other.done)), t(std::move(other.t)), native(std::move(other.native)),
+        native_id(std::exchange(other.native_id, std::thread::id())),
+        deferred(std::move(other.deferred))
+    {}
+
+    joining_thread& operator=(joining_thread&& other) noexcept {
+        if(joinable()) {
+            request_stop();
+            join();
+        }
+        stop = std::move(other.stop);
+        done = std::move(other.done);
+        t = std::move(other.t);
+        native = std::move(other.native);
+        native_id = std::exchange(other.native_id, std::thread::id());
+        live = std::move(other.live);
+        deferred = std::move(other.deferred);
+        return *this;
+    }
+
+    joining_thread& operator=(std::thread other) noexcept {
+        if(joinable()) {
+            request_stop();
+            join();
+        }
+        stop = std::stop_source(); // the adopted thread never saw the old token
+        done.reset();
+        deferred.reset();
+        t = std::move(other);
+        if(t.joinable())
+            live.acquire();
+        return *this;
+    } 
+
+    ~joining_thread() noexcept {
+        if(joinable()) {
+            request_stop();
+            join();
+        }
+    }
+
+    void swap(joining_thread &other) noexcept {
+        stop.swap(other.stop);
+        done.swap(other.done);
+        t.swap(other.t);
+        std::swap(native, other.native);
+        std::swap(native_id, other.native_id);
+        deferred.swap(other.deferred);
+        live.swap(other.live);
+    }
+
+    // Creates the thread of a deferred_start joining_thread; does nothing if it's already
+    // running or wasn't deferred. Throws std::system_error like std::thread's constructor.
+    void start() {
+        if(!deferred)
+            return;
+        t = deferred->launch(*this);
+        deferred.reset();
+    }
+
+    bool started() const noexcept {
+        return !deferred;
+    }
+
+    bool request_stop() noexcept {
+        return stop.request_stop();
+    }
+
+    std::stop_source get_stop_source() noexcept {
+        return stop;
+    }
+
+    std::stop_token get_stop_token() const noexcept {
+        return stop.get_token();
+    }
+
+    std::thread::id get_id() const noexcept {
+        return native.joinable() ? native_id : t.get_id();
+    }
+
+    bool joinable() const noexcept {
+        return t.joinable() || native.joinable();
+    }
+   
+    void join() {
+        auto const start = thread_metrics::now();
+        if(done && joinable())
+            done->wait(); // spin, then park; join() below only waits for the exit
+        if(native.joinable()) {
+            native.join();
+            native_id = std::thread::id();
+        }
+        else
+            t.join();
+        thread_metrics::joined(start);
+        live.release();
+        done.reset();
+    }
+    
+    void detach() {
+        if(native.joinable()) {
+            native.detach();
+            native_id = std::thread::id();
+        }
+        else
+            t.detach();
+        live.release();
+        done.reset();
+    }
+    
+    // Empty for a thread launched with a stack size, see thread_launch_options
+    std::thread &as_thread() noexcept {
+        return t;
+    }
+   
+    const std::thread &as_thread() const noexcept {
+        return t;
+    }
+};
+
+/** Passing large arguments without copies
+ * 
+ * oops() and oops_again() in 2.2 offer two options: copy the buffer into a std::string for
+ * every launch, or pass std::ref and make sure by hand that it outlives the thread.
+ * 
+ *  - std::thread stores its own copy of every argument, but an rvalue is moved into it:
+ *    std::move a big payload in and nothing is copied
+ *  - shared_span<T> is a read-only view that co-owns its buffer, so several threads can read
+ *    one payload and it stays alive until the last of them is done; subspan() splits it
+ *    between threads without copying
+ *  - launch_owning() (and submit_owning() on the pool in 9.1) static_assert against anything
+ *    that can dangle: raw pointers like buffer, std::span, std::string_view,
+ *    std::reference_wrapper, and lvalues too big to copy silently
+*/
+
+template <typename T>
+class shared_span
+{
+    std::shared_ptr<void const> owner;
+    std::span<T const> view;
+
+public:
+    shared_span() = default;
+
+    // view must point into memory kept alive by owner
+    shared_span(std::shared_ptr<void const> owner_, std::span<T const> view_) noexcept
+        : owner(std::move(owner_)), view(view_)
+    {}
+
+    shared_span subspan(std::size_t offset, std::size_t count = std::dynamic_extent) const
+    {
+        return shared_span(owner, view.subspan(offset, count));
+    }
+
+    std::span<T const> span() const noexcept { return view; }
+    T const *data() const noexcept { return view.data(); }
+    std::size_t size() const noexcept { return view.size(); }
+    bool empty() const noexcept { return view.empty(); }
+    auto begin() const noexcept { return view.begin(); }
+    auto end() const noexcept { return view.end(); }
+    T const &operator[](std::size_t i) const { return view[i]; }
+};
+
+template <typename T>
+shared_span<T> make_shared_span(std::vector<T> &&data)
+{
+    auto owner = std::make_shared<std::vector<T> const>(std::move(data));
+    std::span<T const> const view(*owner);
+    return shared_span<T>(std::move(owner), view);
+}
+
+inline shared_span<char> make_shared_span(std::string &&data)
+{
+    auto owner = std::make_shared<std::string const>(std::move(data));
+    std::span<char const> const view(owner->data(), owner->size());
+    return shared_span<char>(std::move(owner), view);
+}
+
+namespace detail
+{
+    template <typename T>
+    struct is_non_owning_view : std::false_type {};
+    template <typename T, std::size_t Extent>
+    struct is_non_owning_view<std::span<T, Extent>> : std::true_type {};
+    template <typename Char, typename Traits>
+    struct is_non_owning_view<std::basic_string_view<Char, Traits>> : std::true_type {};
+    template <typename T>
+    struct is_non_owning_view<std::reference_wrapper<T>> : std::true_type {};
+
+    template <typename T>
+    struct is_shared_span : std::false_type {};
+    template <typename T>
+    struct is_shared_span<shared_span<T>> : std::true_type {};
+
+    constexpr std::size_t max_implicit_copy_bytes = 64;
+
+    // Arg as deduced by a forwarding reference: T& for lvalues
+    template <typename Arg>
+    constexpr void check_owning_argument()
+    {
+        using value_type = std::decay_t<Arg>;
+        static_assert(!std::is_pointer_v<value_type> ||
+                          std::is_function_v<std::remove_pointer_t<value_type>>,
+                      "raw pointer argument may dangle (see oops()): pass an owning type, "
+                      "a std::shared_ptr or a shared_span");
+        static_assert(!is_non_owning_view<value_type>::value,
+                      "non-owning view may dangle: use shared_span");
+        static_assert(!std::is_lvalue_reference_v<Arg> || is_shared_span<value_type>::value ||
+                          (std::is_trivially_copyable_v<value_type> &&
+                           sizeof(value_type) <= max_implicit_copy_bytes),
+                      "this lvalue would be copied: std::move it in or share it with shared_span");
+    }
+}
+
+template <typename Callable, typename ... Args>
+joining_thread launch_owning(Callable &&func, Args &&...args)
+{
+    (detail::check_owning_argument<Args>(), ...);
+    return joining_thread(std::forward<Callable>(func), std::forward<Args>(args)...);
+}
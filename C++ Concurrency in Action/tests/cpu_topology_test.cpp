@@ -0,0 +1,84 @@
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "../include/thread_pool.h"
+
+/*** Tests for cpu_topology::detect (9.1.6) on a fake sysfs tree
+ *
+ * Two sockets, two cores each, two SMT threads per core. Node 0 has socket 0, node 1 is
+ * memory-only, node 2 has socket 1:
+ *
+ *     cpu  0 1 2 3 4 5 6 7
+ *     core 0 0 1 1 0 0 1 1
+ *     node 0 0 0 0 2 2 2 2
+*/
+
+static int failures = 0;
+
+static void check(bool ok, char const *what)
+{
+    if (!ok)
+    {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+static void write_file(std::filesystem::path const &path, std::string const &line)
+{
+    std::filesystem::create_directories(path.parent_path());
+    std::ofstream(path) << line << '\n';
+}
+
+static std::filesystem::path make_fake_sysfs()
+{
+    std::filesystem::path const root =
+        std::filesystem::temp_directory_path() / "cpu_topology_test";
+    std::filesystem::remove_all(root);
+
+    write_file(root / "node/online", "0-2");
+    write_file(root / "node/node0/cpulist", "0-3");
+    write_file(root / "node/node1/cpulist", "");
+    write_file(root / "node/node2/cpulist", "4-7");
+    for (unsigned id = 0; id < 8; ++id)
+    {
+        std::filesystem::path const base = root / ("cpu/cpu" + std::to_string(id)) / "topology";
+        unsigned const first_sibling = id & ~1u;
+        write_file(base / "physical_package_id", std::to_string(id / 4));
+        write_file(base / "core_id", std::to_string((id / 2) % 2));
+        write_file(base / "thread_siblings_list",
+                   std::to_string(first_sibling) + "-" + std::to_string(first_sibling + 1));
+    }
+    return root;
+}
+
+int main()
+{
+    std::filesystem::path const root = make_fake_sysfs();
+    cpu_topology const topology = cpu_topology::detect(root.string() + "/");
+
+    check(topology.cpus.size() == 8, "all CPUs found");
+    check(topology.node_count == 2, "memory-only node skipped");
+    check(topology.os_nodes == std::vector<unsigned>{0, 2}, "sparse node numbers kept");
+    check(topology.node_index(2) == 1 && topology.node_index(1) == -1, "node_index");
+    check(topology.socket_count == 2, "socket count");
+    check(topology.cpus_on_socket(1) == std::vector<unsigned>{4, 5, 6, 7}, "cpus_on_socket");
+    check(topology.cpus_per_core() == std::vector<unsigned>{0, 2, 4, 6}, "one CPU per core");
+
+    cpu_topology::cpu const *five = topology.find_cpu(5);
+    check(five && five->socket == 1 && five->core == 0 && five->node == 1, "cpu5 placement");
+    check(five && five->siblings == std::vector<unsigned>{4, 5}, "cpu5 SMT siblings");
+
+    // No topology files: socket 0, each CPU its own core
+    std::filesystem::remove_all(root / "cpu");
+    cpu_topology const bare = cpu_topology::detect(root.string() + "/");
+    cpu_topology::cpu const *three = bare.find_cpu(3);
+    check(three && three->socket == 0 && three->core == 3, "fallback socket and core");
+    check(three && three->siblings == std::vector<unsigned>{3}, "fallback siblings");
+
+    std::filesystem::remove_all(root);
+    return failures == 0 ? 0 : 1;
+}
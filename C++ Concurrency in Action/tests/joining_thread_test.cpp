@@ -0,0 +1,102 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <thread>
+#include <utility>
+
+#include "../include/thread_wrappers.h"
+
+/*** Tests for joining_thread with thread_launch_options (2.3)
+ *
+ * A stack size goes to that one launch: the thread reports the size it got, and the
+ * process-wide default attributes are left alone.
+*/
+
+static int failures = 0;
+
+static void check(bool ok, char const *what)
+{
+    if (!ok)
+    {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+#if defined(__GLIBC__)
+static std::size_t own_stack_size()
+{
+    pthread_attr_t attr;
+    std::size_t size = 0;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0)
+    {
+        pthread_attr_getstacksize(&attr, &size);
+        pthread_attr_destroy(&attr);
+    }
+    return size;
+}
+
+static std::size_t default_stack_size()
+{
+    pthread_attr_t attr;
+    std::size_t size = 0;
+    if (pthread_getattr_default_np(&attr) == 0)
+    {
+        pthread_attr_getstacksize(&attr, &size);
+        pthread_attr_destroy(&attr);
+    }
+    return size;
+}
+#endif
+
+static void test_stack_size()
+{
+#if defined(__GLIBC__)
+    std::size_t const requested = 1 << 20;
+    std::size_t const default_before = default_stack_size();
+    std::atomic<std::size_t> seen{0};
+    std::atomic<std::size_t> default_while_running{0};
+    std::atomic<bool> release{false};
+
+    thread_launch_options options;
+    options.stack_size = requested;
+    joining_thread t(options, [&] {
+        seen = own_stack_size();
+        while (!release)
+            std::this_thread::yield();
+    });
+    default_while_running = default_stack_size();
+    check(t.joinable(), "stack size: joinable");
+    check(t.get_id() != std::thread::id() && t.get_id() != std::this_thread::get_id(),
+          "stack size: get_id");
+    check(!t.as_thread().joinable(), "stack size: not a std::thread");
+
+    joining_thread moved(std::move(t));
+    check(!t.joinable() && moved.joinable(), "stack size: move");
+    release = true;
+    moved.join();
+
+    check(seen >= requested, "stack size: thread got the requested stack");
+    check(default_while_running == default_before, "stack size: default attributes untouched");
+    check(!moved.joinable() && moved.get_id() == std::thread::id(), "stack size: joined");
+#endif
+}
+
+static void test_without_stack_size()
+{
+    std::atomic<bool> ran{false};
+    thread_launch_options options;
+    options.name = "no-stack-size";
+    {
+        joining_thread t(options, [&] { ran = true; });
+        check(t.as_thread().joinable(), "no stack size: a std::thread");
+    }
+    check(ran, "no stack size: ran");
+}
+
+int main()
+{
+    test_stack_size();
+    test_without_stack_size();
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "../include/pooled_accumulate.h"
+
+/*** Tests for parallel_accumulate on the pool (9.1.2 - 9.1.3)
+ *
+ * counted records whether any addition happened off the calling thread. accumulate_block
+ * can't vectorize it, so every element goes through operator+.
+*/
+
+static int failures = 0;
+
+static void check(bool ok, char const *what)
+{
+    if (!ok)
+    {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+static std::thread::id caller;
+static std::atomic<bool> added_off_caller{false};
+
+struct counted
+{
+    long value = 0;
+};
+
+static counted operator+(counted a, counted b)
+{
+    if (std::this_thread::get_id() != caller)
+        added_off_caller.store(true, std::memory_order_relaxed);
+    return {a.value + b.value};
+}
+
+using counted_iterator = std::vector<counted>::const_iterator;
+
+// Short, uncalibrated: summed inline, nothing submitted and nothing cached
+static void test_short_input_stays_on_caller()
+{
+    thread_pool pool(4);
+    caller = std::this_thread::get_id();
+    added_off_caller = false;
+
+    std::vector<counted> const values(1000, counted{1});
+    for (int call = 0; call < 100; ++call)
+    {
+        counted const sum = parallel_accumulate(pool, values.begin(), values.end(), counted{5});
+        check(sum.value == 1005, "short input: sum");
+    }
+    check(!added_off_caller, "short input: no block ran on a worker");
+    check(accumulate_cost<counted_iterator, counted>::ns_per_element.load() == 0.0,
+          "short input: no grain size cached");
+}
+
+// Long enough to calibrate: the warm-up and sample count towards the result
+static void test_calibrated_sum()
+{
+    thread_pool pool(4);
+    std::vector<int> const values(3 * calibration_elements + 17, 1);
+    long const first = parallel_accumulate(pool, values.begin(), values.end(), 3L);
+    long const second = parallel_accumulate(pool, values.begin(), values.end(), 3L);
+    check(first == static_cast<long>(values.size()) + 3, "calibrating call: sum");
+    check(second == first, "calibrated call: sum");
+    check(accumulate_cost<std::vector<int>::const_iterator, long>::ns_per_element.load() > 0.0,
+          "calibrating call: grain size cached");
+}
+
+int main()
+{
+    test_short_input_stays_on_caller();
+    test_calibrated_sum();
+    return failures == 0 ? 0 : 1;
+}
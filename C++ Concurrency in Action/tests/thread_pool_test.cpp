@@ -0,0 +1,87 @@
+#include <cstddef>
+#include <cstdio>
+#include <future>
+#include <vector>
+
+#include "../include/thread_pool.h"
+
+/*** Tests for thread_pool (9.1)
+ *
+ * Also built as thread_pool_test_tsan: under -fsanitize=thread a worker has already used
+ * hundreds of KB of its stack before it takes work, which is where prefaulting used to run
+ * off the end.
+*/
+
+static int failures = 0;
+
+static void check(bool ok, char const *what)
+{
+    if (!ok)
+    {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+// prefault_stack_bytes as large as (or larger than) the stack itself must be clamped
+static void test_prefault_larger_than_stack()
+{
+    struct sizes
+    {
+        std::size_t stack;
+        std::size_t prefault;
+    };
+    for (sizes const s : {sizes{256 * 1024, 128 * 1024}, sizes{1 << 20, 1 << 20},
+                          sizes{4 << 20, 4 << 20}, sizes{256 * 1024, 64 << 20}})
+    {
+        pool_options options;
+        options.thread_count = 2;
+        options.stack_size = s.stack;
+        options.prefault_stack_bytes = s.prefault;
+        thread_pool pool(options);
+
+        std::vector<std::future<int>> results;
+        for (int i = 0; i < 8; ++i)
+            results.push_back(pool.submit([i] { return i * i; }));
+        int sum = 0;
+        for (auto &entry : results)
+            sum += entry.get();
+        check(sum == 140, "prefault clamped: tasks ran");
+    }
+}
+
+// A default-constructed bulk_handle behaves like a std::future without state
+static void test_empty_bulk_handle()
+{
+    bulk_handle const empty;
+    check(!empty.valid(), "empty bulk_handle: not valid");
+
+    auto throws_no_state = [](auto &&call) {
+        try
+        {
+            call();
+        }
+        catch (std::future_error const &e)
+        {
+            return e.code() == std::future_errc::no_state;
+        }
+        return false;
+    };
+    check(throws_no_state([&] { (void)empty.is_ready(); }), "empty bulk_handle: is_ready");
+    check(throws_no_state([&] { (void)empty.size(); }), "empty bulk_handle: size");
+    check(throws_no_state([&] { empty.wait(); }), "empty bulk_handle: wait");
+    check(throws_no_state([&] { empty.get(); }), "empty bulk_handle: get");
+
+    thread_pool pool(2);
+    std::vector<int> values(1000, 0);
+    bulk_handle const batch = pool.submit_bulk(values, [](int &v) { v = 2; });
+    batch.get();
+    check(batch.valid() && batch.is_ready() && batch.size() == values.size(), "bulk_handle: done");
+}
+
+int main()
+{
+    test_prefault_larger_than_stack();
+    test_empty_bulk_handle();
+    return failures == 0 ? 0 : 1;
+}